@@ -0,0 +1,48 @@
+#!/bin/sh
+# Times xv6_fsck on images built by xv6_mkimg, from small to a million inodes.
+# For each size the clean image is checked in full, then one image per check
+# is corrupted so that check fails first, timing the checker up to it.
+#
+# Usage: ./bench.sh [xv6_fsck flags], e.g. ./bench.sh -j 4
+# Output: one tab-separated line per run: inodes, check (or "clean"), seconds,
+# the best of RUNS runs (default 3).
+
+set -e
+RUNS=${RUNS:-3}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+gcc -O2 -pthread -o "$DIR/xv6_fsck" xv6_fsck.c
+gcc -O2 -o "$DIR/xv6_mkimg" xv6_mkimg.c
+
+# inodes blocks depth fanout files file_blocks
+SIZES="200 8192 3 3 3 20
+10000 100000 4 6 8 20
+65536 1200000 6 6 8 16
+1000000 1200000 6 6 8 16"
+
+# best wall time of RUNS runs of the checker on an image, in seconds
+best() {
+  b=""
+  i=0
+  while [ $i -lt "$RUNS" ]; do
+    t0=$(date +%s%N)
+    "$DIR/xv6_fsck" "$@" 2>/dev/null || true
+    t1=$(date +%s%N)
+    t=$((t1 - t0))
+    if [ -z "$b" ] || [ $t -lt "$b" ]; then b=$t; fi
+    i=$((i + 1))
+  done
+  printf '%d.%06d' $((b / 1000000000)) $((b % 1000000000 / 1000))
+}
+
+printf 'inodes\tcheck\tseconds\n'
+echo "$SIZES" | while read -r n b d f files fblocks; do
+  for c in clean 1 2A 2B 3 4 5 6 7 8 9 10 11 12 E1 E2; do
+    opt=""
+    [ "$c" = clean ] || opt="-c $c"
+    "$DIR/xv6_mkimg" -i "$n" -b "$b" -d "$d" -f "$f" -n "$files" -k "$fblocks" \
+                     $opt "$DIR/fs.img"
+    printf '%s\t%s\t%s\n' "$n" "$c" "$(best "$@" "$DIR/fs.img")"
+  done
+done
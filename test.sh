@@ -0,0 +1,98 @@
+#!/bin/sh
+# Checks what xv6_fsck does to images built by xv6_mkimg and then corrupted
+# by hand, where the corruption is one xv6_mkimg -c does not make.
+#
+# Usage: ./test.sh
+# Output: one line per failed test; the exit status is the number of them.
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+FAILED=0
+
+gcc -O2 -pthread -o "$DIR/xv6_fsck" xv6_fsck.c || exit 1
+gcc -O2 -o "$DIR/xv6_mkimg" xv6_mkimg.c || exit 1
+
+# prints the check and message of every violation the library passes on
+# for the image, as --all would find them
+cat > "$DIR/violations.c" <<'EOF'
+#include <stdio.h>
+#include <stdlib.h>
+#include "xv6fsck.h"
+
+void print(const struct xv6fsck_violation *v, void *arg) {
+  printf("%s|%s\n", v->check, v->error);
+}
+
+int main(int argc, char *argv[]) {
+  struct xv6fsck_options o = { .report_all = 1, .violation = print };
+  FILE *f = fopen(argv[1], "rb");
+  char *image;
+  long len;
+
+  if ((f == NULL) || (fseek(f, 0, SEEK_END) < 0) || ((len = ftell(f)) < 0))
+    return 2;
+  rewind(f);
+  if (((image = malloc(len)) == NULL) || (fread(image, 1, len, f) != len))
+    return 2;
+  return (xv6fsck_check(image, len, &o, NULL) < 0) ? 2 : 0;
+}
+EOF
+gcc -O2 -pthread -I. -DXV6FSCK_LIB -o "$DIR/violations" "$DIR/violations.c" \
+    xv6_fsck.c || exit 1
+
+# write inode n of a 512-byte-block v6 image, from its first field on, as
+# printf octal escapes of the bytes
+poke_inode() {
+  printf "$2" | dd of="$1" bs=1 seek=$((2 * 512 + 64 * $3)) conv=notrunc \
+                   2>/dev/null
+}
+
+fail() {
+  echo "FAIL: $*"
+  FAILED=$((FAILED + 1))
+}
+
+# a repair needs checks #1-4 to pass for every inode, even one after the
+# inode check #5 fails on
+"$DIR/xv6_mkimg" -i 200 -b 8192 -c 5 -s 3 "$DIR/fs.img"
+poke_inode "$DIR/fs.img" '\011\000' 199 # a type that is none
+sum=$(cksum < "$DIR/fs.img")
+"$DIR/xv6_fsck" -r "$DIR/fs.img" > /dev/null 2>&1 &&
+  fail "check #5 then #1: repaired"
+[ "$(cksum < "$DIR/fs.img")" = "$sum" ] ||
+  fail "check #5 then #1: image written"
+
+# an image that fails check #5 is repaired in full, lost inodes included
+"$DIR/xv6_mkimg" -i 200 -b 8192 -c 9 -s 3 "$DIR/fs.img"
+printf '\000' | dd of="$DIR/fs.img" bs=1 seek=$((28 * 512 + 4)) conv=notrunc \
+                   2>/dev/null # blocks 32-39 marked free
+"$DIR/xv6_fsck" -r "$DIR/fs.img" > /dev/null 2>&1 ||
+  fail "check #5 with lost inodes: not repaired"
+"$DIR/xv6_fsck" "$DIR/fs.img" > /dev/null 2>&1 ||
+  fail "check #5 with lost inodes: repair left errors"
+
+# the library passes on the message as --all has it, not as a line
+"$DIR/xv6_mkimg" -i 200 -b 8192 -c E2 -s 3 "$DIR/fs.img"
+msg=$("$DIR/violations" "$DIR/fs.img" | head -n 1)
+[ "$msg" = "E2|inaccessible directory exists." ] ||
+  fail "library message: $msg"
+
+# the records of a small image fit in the smallest limit
+"$DIR/xv6_mkimg" -i 200 -b 8192 -s 3 "$DIR/fs.img"
+"$DIR/xv6_fsck" --memory-limit 1 "$DIR/fs.img" > /dev/null 2>&1 ||
+  fail "--memory-limit 1: refused a 200-inode image"
+
+# --all finds first the violation the default run reports, even with the
+# root inode not in use
+"$DIR/xv6_mkimg" -i 200 -b 8192 -s 3 "$DIR/fs.img"
+poke_inode "$DIR/fs.img" '\000\000\000\000\000\000\000\000' 1
+msg=$("$DIR/xv6_fsck" "$DIR/fs.img" 2>&1)
+[ "$msg" = "ERROR: bitmap marks block in use but it is not in use." ] ||
+  fail "unused root: $msg"
+msg=$("$DIR/xv6_fsck" --all "$DIR/fs.img" | head -n 1)
+case "$msg" in
+  '{"check":"6",'*) ;;
+  *) fail "unused root with --all: $msg" ;;
+esac
+
+exit $FAILED
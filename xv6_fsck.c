@@ -1,17 +1,34 @@
+#define _GNU_SOURCE // SEEK_DATA, SEEK_HOLE and fallocate
+
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <malloc.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <setjmp.h>
+
+#include "xv6fsck.h"
 
 // The entirety of the fs.h xv6 header file has been copied into this source
 // file for portability purposes. All variables, structs, and macros defined
 // within the fs.h file are credited to their respective authors.
 //
-// Additional variables and macros defined below the dirent struct are my own.
+// Additional variables and macros defined below the dirent struct are my own,
+// as are the layouts: the macros that depend on the block size take it as
+// an argument, and IBLOCK and BBLOCK take the superblock as in later xv6.
 
 // Block 0 is unused.
 // Block 1 is super block.
@@ -20,16 +37,37 @@
 #define ROOTINO 1  // root i-number
 #define BSIZE 512  // block size
 
-// File system super block
+// The layouts of xv6 the checker knows, told apart by the superblock:
+//   v6     the one above, 512-byte blocks and a superblock of size, nblocks
+//          and ninodes, with the bitmap right after the inode table
+//   log    x86 xv6 once the superblock gained nlog, logstart, inodestart
+//          and bmapstart: 512-byte blocks, the log before the inode table
+//   riscv  RISC-V xv6: as log with 1024-byte blocks, and a superblock
+//          starting with FSMAGIC
+enum { LAYOUT_V6, LAYOUT_LOG, LAYOUT_RISCV };
+
+#define MAXBSIZE 1024  // the largest block size of any layout
+#define FSMAGIC 0x10203040
+
+// File system super block, as kept for every layout; read_superblock fills
+// in what a layout does not store. The first seven fields are those of the
+// log layout on disk
 struct superblock {
   uint size;         // Size of file system image (blocks)
   uint nblocks;      // Number of data blocks
   uint ninodes;      // Number of inodes.
+  uint nlog;         // Number of log blocks
+  uint logstart;     // Block number of first log block
+  uint inodestart;   // Block number of first inode block
+  uint bmapstart;    // Block number of first free map block
+  uint bsize;        // block size
+  uint dataend;      // check #6 looks at data blocks below this
+  int layout;
 };
 
 #define NDIRECT (12)
-#define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NINDIRECT(bs) ((bs) / sizeof(uint))
+#define MAXFILE(bs) (NDIRECT + NINDIRECT(bs))
 
 struct dinode {
   short type;           // File type
@@ -45,16 +83,16 @@ struct dinode {
 #define T_DEV  3   // Special device
 
 // Inodes per block.
-#define IPB           (BSIZE / sizeof(struct dinode))
+#define IPB(bs)       ((bs) / sizeof(struct dinode))
 
 // Block containing inode i
-#define IBLOCK(i)     ((i) / IPB + 2)
+#define IBLOCK(i, sb) ((i) / IPB((sb)->bsize) + (sb)->inodestart)
 
 // Bitmap bits per block
-#define BPB           (BSIZE*8)
+#define BPB(bs)       ((bs)*8)
 
 // Block containing bit for block b
-#define BBLOCK(b, ninodes) (b/BPB + (ninodes)/IPB + 3)
+#define BBLOCK(b, sb) ((b) / BPB((sb)->bsize) + (sb)->bmapstart)
 
 // Directory is a file containing a sequence of dirent structures.
 #define DIRSIZ 14
@@ -65,742 +103,5790 @@ struct dirent {
 };
 
 // Dirents per block
-#define DPB (BSIZE/sizeof(struct dirent))
+#define DPB(bs) ((bs)/sizeof(struct dirent))
 
 #define CHECKBIT(bm, b_addr) (((*(bm + b_addr / 8)) & (1 << (b_addr % 8))) > 0)
 
-int *used_datablocks;
-int *in_use_inums;
+// packed bitmaps in the on-disk layout: bit b is bit b%64 of word b/64
+#define SETBIT(bits, b) ((bits)[(b) / 64] |= (uint64_t) 1 << ((b) % 64))
+#define BITWORDS(n) (((uint64_t) (n) + 63) / 64)
 
-// check #1
-int check_valid_inodes(int type) {
-  switch(type) {
-    case T_DIR :
-      break;
-    case T_FILE :
-      break;
-    case T_DEV :
-      break;
-    default : // non-standard type, error
-      return -1;
+// popcounts over a range of two packed bitmaps a and b
+struct bit_counts {
+  uint64_t set;    // bits set in a
+  uint64_t diff;   // bits set in a but not in b
+  uint64_t first;  // first bit set in a but not in b, or the end of range
+};
+
+// accumulate bit_counts over whole words [lo, hi)
+void andnot_words(const uint64_t *a,
+                  const uint64_t *b,
+                  uint64_t lo,
+                  uint64_t hi,
+                  uint64_t end,
+                  struct bit_counts *c) {
+  for (uint64_t w = lo; w < hi; w++) {
+    uint64_t d = a[w] & ~b[w];
+    c->set += __builtin_popcountll(a[w]);
+    c->diff += __builtin_popcountll(d);
+    if (d && (c->first == end))
+      c->first = w*64 + __builtin_ctzll(d);
   }
-  return 0;
 }
 
-// check #2A
-int check_valid_direct(struct dinode *node, int size) {
-  uint b_addr;
-  for (int i = 0; i < NDIRECT; i++) { // loop through all direct blocks
-    b_addr = node->addrs[i];
-    if (b_addr == 0) // address not in use
-      continue;
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
 
-    // address outside of possible address space, error
-    if ((b_addr < 0) || (b_addr >= size))
-      return -1;
-  }
-  return 0;
+// popcount of each 64-bit lane, from a nibble lookup table
+__attribute__((target("avx2")))
+static inline __m256i popcount256(__m256i v) {
+  const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+                                       1, 2, 2, 3, 2, 3, 3, 4,
+                                       0, 1, 1, 2, 1, 2, 2, 3,
+                                       1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, nibble));
+  __m256i hi = _mm256_shuffle_epi8(lut,
+                 _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+  return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
 }
 
-// check #2B
-int check_valid_indirect(void *mem_start, struct dinode *node, int size) {
-  uint b_addr = node->addrs[NDIRECT];
-  if (b_addr == 0) // address not in use
-    return 0;
-  // address outside of possible address space, error
-  else if ((b_addr < 0) || (b_addr >= size))
-    return -1;
-
-  uint *i_block = (uint *) (mem_start + b_addr*BSIZE);
-  // loop through indirect blocks
-  for (int i = 0; i < NINDIRECT; i++, i_block++) {
-    b_addr = *(i_block);
-    if (b_addr == 0) // address not in use
-      continue;
+// andnot_words, 256 bits at a time
+__attribute__((target("avx2")))
+void andnot_words_avx2(const uint64_t *a,
+                       const uint64_t *b,
+                       uint64_t lo,
+                       uint64_t hi,
+                       uint64_t end,
+                       struct bit_counts *c) {
+  __m256i set = _mm256_setzero_si256();
+  __m256i diff = _mm256_setzero_si256();
+  uint64_t w = lo;
 
-    // address outside of possible address space, error
-    if ((b_addr < 0) || (b_addr >= size))
-      return -1;
+  for (; w + 4 <= hi; w += 4) {
+    __m256i va = _mm256_loadu_si256((const __m256i *) (a + w));
+    __m256i vb = _mm256_loadu_si256((const __m256i *) (b + w));
+    __m256i d = _mm256_andnot_si256(vb, va);
+    set = _mm256_add_epi64(set, popcount256(va));
+    diff = _mm256_add_epi64(diff, popcount256(d));
+    if (!_mm256_testz_si256(d, d) && (c->first == end)) {
+      struct bit_counts none = { 0, 0, end };
+      andnot_words(a, b, w, w + 4, end, &none);
+      c->first = none.first;
+    }
   }
 
-  return 0;
-}
-
-// check #3 and #4
-int check_valid_dir(void *mem_start, struct dinode *node, int inum) {
-  uint b_addr;
-  struct dirent *d_entry;
-  int cd, pd; // used for tracking current directory and parent directory
-  cd = pd = 0;
-
-  // loop through all direct blocks
-  for (int i = 0; i < NDIRECT; i++) {
-    b_addr = node->addrs[i];
-    if (b_addr == 0) // address not in use
-      continue;
+  uint64_t lanes[4];
+  _mm256_storeu_si256((__m256i *) lanes, set);
+  c->set += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  _mm256_storeu_si256((__m256i *) lanes, diff);
+  c->diff += lanes[0] + lanes[1] + lanes[2] + lanes[3];
 
-    d_entry = (struct dirent *) (mem_start + b_addr*BSIZE);
-    // loop through all dirents in block
-    for (int j = 0; j < DPB; j++, d_entry++) {
-      if (strcmp(d_entry->name, ".") == 0) { // found current directory
-        cd = 1;
-        if (d_entry->inum != inum) // cd not properly numbered, error
-	  return -1;
-      }
-    
-      if (strcmp(d_entry->name, "..") == 0) { // found parent directory
-        pd = 1;
-	if (inum != 1) { // not in root directory
-          // if not found current directory and
-	  // parent directory not properly numbered, error
-          if (!cd && (d_entry->inum != inum))
-	    return -1;
-	} else { // in root directory
-          if (d_entry->inum != inum) // rd not properly numbered, error
-	    return -1;
-	}
-      }
+  andnot_words(a, b, w, hi, end, c);
+}
+#endif
 
-      if (cd && pd) // found both current and root directories, success
-        return 0;
+// accumulate bit_counts over bits [lo, hi) one bit at a time, for the
+// partial words at either end of a range
+void andnot_edge(const uint64_t *a,
+                 const uint64_t *b,
+                 uint64_t lo,
+                 uint64_t hi,
+                 uint64_t end,
+                 struct bit_counts *c) {
+  for (uint64_t i = lo; i < hi; i++) {
+    int in_a = (a[i / 64] >> (i % 64)) & 1;
+    int in_b = (b[i / 64] >> (i % 64)) & 1;
+    c->set += in_a;
+    if (in_a && !in_b) {
+      c->diff++;
+      if (c->first == end)
+        c->first = i;
     }
   }
-  return -1; // current and/or parent directory not found, error
 }
 
-// check #5
-int check_valid_bitmap(void *mem_start,
-		       struct dinode *node,
-		       int ninodes,
-		       int inum) {
-  
-  int b = BBLOCK(0, ninodes); // find block containing initial inode
-  char *bm = (char *) (mem_start + b*BSIZE); // bitmap
-  uint b_addr;
+struct dirent_kinds;
 
-  // loop through all address blocks (direct and indirect) in each inode
-  for (int i = 0; i <= NDIRECT; i++) {
-    b_addr = node->addrs[i];
-    if (b_addr == 0) // address not in use
-      continue;
-    if (i == NDIRECT) { // reached indirect block
-      uint *i_block = (uint *) (mem_start + b_addr*BSIZE);
-      // loop through all indirect blocks
-      for (int j = 0; j < NINDIRECT; j++, i_block++) {
-        b_addr = *i_block;
-	if (b_addr == 0) // address not in use
-          continue;
-	// if inode in use but marked free in bitmap, error
-	if (!CHECKBIT(bm, b_addr)) {
-	  return -1;
-	}
-      }
-      // if inode in use but marked free in bitmap, error
-    } else if (!CHECKBIT(bm, b_addr)) {
-      return -1;
-    }
-  }
-  return 0;
-}
+// the vector kernels where the processor has them, and the portable ones
+// otherwise; picked once, by pick_kernels, when the checker is loaded
+struct kernels {
+  void (*andnot_words)(const uint64_t *, const uint64_t *,
+                       uint64_t, uint64_t, uint64_t, struct bit_counts *);
+  void (*classify)(const struct dirent *, struct dirent_kinds *);
+};
 
-// helper for check #6
-void find_used_datablocks(void *mem_start, struct dinode *dip, int ninodes) {
-  uint b_addr, *i_block;
+struct kernels kernels;
 
-  // loop through all address blocks (direct and indirect) in each inode
-  for (int i = 0; i <= NDIRECT; i++) {
-    b_addr = dip->addrs[i];
-    if (b_addr == 0) // address not in use
-      continue;
+// bit_counts over bits [lo, hi)
+void andnot_bits(const uint64_t *a,
+                 const uint64_t *b,
+                 uint64_t lo,
+                 uint64_t hi,
+                 struct bit_counts *c) {
+  uint64_t wlo = BITWORDS(lo), whi = hi / 64;
 
-    used_datablocks[b_addr] = 1; // mark block as in use
+  c->set = c->diff = 0;
+  c->first = hi;
+  if (lo >= hi)
+    return;
 
-    if (i == NDIRECT) { // reached indirect block
-      i_block = (uint *) (mem_start + b_addr*BSIZE);
+  uint64_t head_end = (wlo*64 < hi) ? wlo*64 : hi;
+  uint64_t tail_start = (whi*64 > head_end) ? whi*64 : head_end;
+  andnot_edge(a, b, lo, head_end, hi, c);
+  if (wlo < whi)
+    kernels.andnot_words(a, b, wlo, whi, hi, c);
+  andnot_edge(a, b, tail_start, hi, hi, c);
+}
 
-      // loop through all indirect blocks
-      for (int j = 0; j < NINDIRECT; j++, i_block++) {
-        b_addr = *i_block;
-	if (b_addr == 0) // address not in use
-	  continue;
+// directory blocks are classified DGROUP entries at a time, one bit each: a
+// whole block of the v6 and log layouts, half a block of the riscv one
+#define DGROUP 32
 
-	used_datablocks[b_addr] = 1; // mark block as in use
-      }
-    }
+// kinds of a group of entries of a directory block, one bit per entry; an
+// entry named neither . nor .. is empty when its inum is 0 and named
+// otherwise
+struct dirent_kinds {
+  uint32_t dot;    // named .
+  uint32_t dotdot; // named ..
+  uint32_t used;   // inum is not 0
+};
+
+// classify the entries of a block one at a time, looking only at the name
+// bytes strcmp would have compared against . and ..
+void classify_entries(const struct dirent *block, struct dirent_kinds *k) {
+  k->dot = k->dotdot = k->used = 0;
+  for (uint j = 0; j < DGROUP; j++) {
+    const char *name = block[j].name;
+    if ((name[0] == '.') && (name[1] == '\0'))
+      k->dot |= (uint32_t) 1 << j;
+    if ((name[0] == '.') && (name[1] == '.') && (name[2] == '\0'))
+      k->dotdot |= (uint32_t) 1 << j;
+    if (block[j].inum != 0)
+      k->used |= (uint32_t) 1 << j;
   }
 }
 
-// check #6
-int check_valid_blocks_in_bitmap(void *mem_start,
-				 struct superblock *sb,
-				 uint db1) {
-  int i;
-  struct dinode *dip = (struct dinode *) (mem_start + 2*BSIZE);
-  int b = BBLOCK(0, sb->ninodes); // find block containing initial inode
-  char *bm = (char *) (mem_start + b*BSIZE); // bitmap
-  uint b_addr;
-
-  // loop through all inodes
-  for (i = 0; i < sb->ninodes; i++, dip++) {
-    if (dip->type == 0) // inodes not in use
-      continue;
+#if defined(__x86_64__) || defined(__i386__)
+// classify_entries, two 16-byte entries per 256-bit load; the inum is bytes
+// 0-1 of an entry and the name starts at byte 2
+__attribute__((target("avx2")))
+void classify_entries_avx2(const struct dirent *block, struct dirent_kinds *k) {
+  const __m256i dots = _mm256_setr_epi8(0, 0, '.', '.', 0, 0, 0, 0,
+                                        0, 0, 0, 0, 0, 0, 0, 0,
+                                        0, 0, '.', '.', 0, 0, 0, 0,
+                                        0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i zero = _mm256_setzero_si256();
+  k->dot = k->dotdot = k->used = 0;
 
-    find_used_datablocks(mem_start, dip, sb->ninodes);
+  for (uint j = 0; j < DGROUP; j += 2) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (block + j));
+    uint32_t d = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, dots));
+    uint32_t z = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+    // bit 2 of each 16-bit half: name[0] is . and name[1] ends it, or
+    // name[0..1] are .. and name[2] ends it; bit 0: both inum bytes are 0
+    uint32_t dot = d & (z >> 1);
+    uint32_t dotdot = d & (d >> 1) & (z >> 2);
+    uint32_t empty = z & (z >> 1);
+    k->dot |= (((dot >> 2) & 1) | ((dot >> 17) & 2)) << j;
+    k->dotdot |= (((dotdot >> 2) & 1) | ((dotdot >> 17) & 2)) << j;
+    k->used |= ((~empty & 1) | ((~empty >> 15) & 2)) << j;
   }
+}
+#endif
 
-  // loop through all data blocks, starting with first data block (db1)
-  for (i = db1; i < sb->nblocks; i++) {
-    b_addr = i;
-    // if data block not in use but marked in use in bitmap, error
-    if (used_datablocks[i] == 0 && CHECKBIT(bm, b_addr))
-      return -1;
+// the kernels for the processor the checker runs on, before main or when
+// the library is loaded, so no check asks again
+__attribute__((constructor))
+void pick_kernels(void) {
+  kernels.andnot_words = andnot_words;
+  kernels.classify = classify_entries;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init(); // constructors may run before the one that does it
+  if (__builtin_cpu_supports("avx2")) {
+    kernels.andnot_words = andnot_words_avx2;
+    kernels.classify = classify_entries_avx2;
   }
-  
-  return 0;
+#endif
 }
 
-// check #7
-int check_direct_addr_use(void *mem_start, int ninodes) {
-  struct dinode *dip = (struct dinode *) (mem_start + 2*BSIZE);
-  uint addr;
-  uint *used_addrs;
-  int i, j, k, total;
-  k = total = 0;
+// classify the DGROUP entries of a directory block from block on
+void classify_dirents(const struct dirent *block, struct dirent_kinds *k) {
+  kernels.classify(block, k);
+}
 
-  if ((used_addrs = malloc(sizeof(uint)*ninodes*NDIRECT)) == NULL)
-    exit(1);
+// room for one block of any layout
+union block {
+  char data[MAXBSIZE];
+  uint addrs[NINDIRECT(MAXBSIZE)];
+  struct dinode inodes[IPB(MAXBSIZE)];
+  struct dirent dirents[DPB(MAXBSIZE)];
+};
 
-  // loop through all inodes
-  for (i = 0; i < ninodes; i++, dip++) {
-    if (dip->type == 0) // inode not in use
-      continue;
+// a function compiled into each of its callers, so that one passing a
+// constant block size gets loops with constant bounds; the scan of the inode
+// table is compiled once for each block size this way
+#define PER_BSIZE static inline __attribute__((always_inline))
 
-    // loop through all direct blocks
-    for (j = 0; j < NDIRECT; j++) {
-      addr = dip->addrs[j];
-      if (addr == 0) // address not in use
-	continue;
+// where a check that cannot go on returns to: set by xv6fsck_check, and by
+// the scan threads it starts, so that a library caller gets an error back
+__thread jmp_buf *bail;
 
-      k = 0;
-      while (k < total) { // loop through all found addresses
-        if (used_addrs[k] == addr) { // found repeat address, error
-	  free(used_addrs);
-	  return -1;
-	}
-	k++;
-      }
-      used_addrs[k] = addr; // add new address
-      total++; // increment total addresses found
-    }
-  }
+// set by the check scheduler to the stop flag of the node a thread runs, so
+// that a long check can give up once an earlier one has failed
+__thread int *node_stop;
 
-  free(used_addrs);
-  return 0;
+// whether the check this thread makes is still needed
+int stopped(void) {
+  return (node_stop != NULL) && __atomic_load_n(node_stop, __ATOMIC_RELAXED);
 }
 
-// check #8
-int check_indirect_addr_use(void *mem_start, int ninodes) {
-  struct dinode *dip = (struct dinode *) (mem_start + 2*BSIZE);
-  uint addr;
-  uint *used_addrs;
-  int i, j, k, total;
-  k = total = 0;
-
-  if ((used_addrs = malloc(sizeof(uint)*ninodes*NINDIRECT)) == NULL)
-    exit(1);
-
-  // loop through all inodes
-  for (i = 0; i < ninodes; i++, dip++) {
-    if (dip->type == 0) // inode not in use
-      continue;
+// give up on the image, for want of memory or of a read or write that failed
+void die(void) {
+  if (bail != NULL)
+    longjmp(*bail, 1);
+  exit(1);
+}
 
-    addr = dip->addrs[NDIRECT];
-    if (addr == 0) // address not in use
-      continue;
+// the image being checked: either mapped whole, or read on demand with
+// pread, with indirect and directory blocks kept in a fixed-size cache
+struct image {
+  char *mem;             // whole image, or NULL when streaming
+  size_t len;
+  int fd;
+  struct block_cache *cache;
+  uint64_t bytes_read;   // by pread, for --stats
+  uint64_t bytes_written; // by repair
+  uint bsize;            // of the layout, BSIZE until it is known
+  uint io_depth;         // reads a scan thread keeps in flight, when streaming
+  struct extent *extents; // where a sparse image holds data, or NULL
+  uint nextents;
+};
 
-    uint *i_block = (uint *) (mem_start + addr*BSIZE);
-    // loop through all indrect blocks
-    for (j = 0; j < NINDIRECT; j++, i_block++) {
-      addr = *i_block;
-      if (addr == 0) // address not in use
-	continue;
+// a cached block, of the block size the cache was made for
+struct cache_entry {
+  uint block;
+  int next;              // next entry in the same hash chain, or -1
+  char used;             // holds a block
+  char ref;              // referenced since the clock hand last passed
+  char data[];
+};
 
-      k = 0;
-      while (k < total) { // loop through all found addresses
-        if (used_addrs[k] == addr) { // found repeat address, error
-	  free(used_addrs);
-	  return -1;
-	}
-	k++;
-      }
-      used_addrs[k] = addr; // add new address
-      total++; // increment total addresses found
-    }
-  }
+// blocks are spread over shards by block number so that threads reading
+// different blocks rarely wait on the same lock; each shard evicts with a
+// clock over its entries
+#define NSHARDS 64
 
-  free(used_addrs);
-  return 0;
-}
+struct cache_shard {
+  pthread_mutex_t lock;
+  uint nentries;
+  uint hand;
+  int *buckets;          // first entry of each hash chain, or -1
+  char *entries;         // esize bytes each
+  size_t esize;
+  uint64_t hits;
+  uint64_t misses;
+};
 
-// helper method for checks #9-12
-void get_inode_info(void *mem_start, int ninodes) {
-  struct dinode *dip = (struct dinode *) (mem_start + 2*BSIZE);
-  struct dirent *d_entry;
-  uint b_addr, *i_block;
-  int i, j, k;
-
-  // loop through all inodes
-  for (i = 0; i < ninodes; i++, dip++) {
-    if (dip->type == T_DIR) {
-      // loop through all direct blocks
-      for (j = 0; j < NDIRECT; j++) {
-        b_addr = dip->addrs[j];
-	if (b_addr == 0) // address not in use
-	  continue;
-
-        d_entry = (struct dirent *) (mem_start + b_addr*BSIZE);
-	// loop through all dirents in current block
-	for (k = 0; k < DPB; k++, d_entry++) {
-          if ((strcmp(d_entry->name, ".") == 0) ||
-	      (strcmp(d_entry->name, "..") == 0))
-            continue;
-          in_use_inums[d_entry->inum]++; // increment current inum count
-	}
-      }
-      b_addr = dip->addrs[j]; // address of indirect block
-      if (b_addr == 0) // address not in use
-	continue;
-
-      i_block = (uint *) (mem_start + b_addr*BSIZE);
-      // loop through all indirect blocks
-      for (j = 0; j < NINDIRECT; j++, i_block++) {
-        b_addr = *i_block;
-        if (b_addr == 0) // address not in use
-	  continue;
-        
-	d_entry = (struct dirent *) (mem_start + b_addr*BSIZE);
-	// loop through all dirents in current block
-	for (k = 0; k < DPB; k++, d_entry++) {
-          if ((strcmp(d_entry->name, ".") == 0) ||
-	      (strcmp(d_entry->name, "..") == 0))
-            continue;
-          in_use_inums[d_entry->inum]++; // increment current inum count
-	}
-      }
-    }
-  }
-}
+struct block_cache {
+  struct cache_shard shards[NSHARDS];
+};
 
-// extra check #1
-int check_parent_dir(void *mem_start, int ninodes) {
-  struct dinode *node = (struct dinode *) (mem_start + 2*BSIZE);
-  struct dirent *d_entry;
-  uint b_addr;
-  int i, j, k, n, found;
+// sparse images
+// an image that is mostly holes still faults in a page of zeros for each
+// hole it is read through when mapped, and reads them like any other bytes
+// when streamed. So the extents of a regular file that hold data are asked
+// for once, with SEEK_DATA and SEEK_HOLE, when it is opened; blocks wholly in
+// a hole are then zeros without being read, and an inode block in one is
+// passed over by the scan, since it holds no inode in use
 
-  // reuse mem to track dir inums
-  int index = 0;
-  free(in_use_inums);
-  if ((in_use_inums = calloc(ninodes, sizeof(int))) == NULL)
-    exit(1);
+// bytes [start, end) of the image hold data
+struct extent {
+  uint64_t start, end;
+};
 
-  // loop through all inodes
-  for (i = 0; i < ninodes; i++, node++) {
-    if (node->type != T_DIR)
-      continue;
+// blocks read_block and read_blocks hand out for holes
+#define ZERO_BLOCKS 64
+const char zeros[ZERO_BLOCKS*MAXBSIZE];
 
-    // look through all blocks (direct and indirect) of current inode
-    for (j = 0; j <= NDIRECT; j++) {
-      b_addr = node->addrs[j];
-      if (b_addr == 0) // address not in use
-	continue;
+// the extents of the len-byte image at fd that hold data, kept in img only
+// if it has holes; a file system that cannot tell leaves the image all data
+void find_extents(struct image *img, int fd, uint64_t len) {
+  struct extent *e = NULL, *more;
+  uint n = 0, cap = 0;
+  off_t data = 0, hole;
 
-      d_entry = (struct dirent *) (mem_start + b_addr*BSIZE);
-      // loop through all dirents in current block
-      for (k = 0; k < DPB; k++, d_entry++) {
-        if (strcmp(d_entry->name, ".") == 0) {
-          in_use_inums[d_entry->inum] = d_entry->inum;
-	  index++;
-	}
-      }
-    }
-  } 
-  
-  node = (struct dinode *) (mem_start + 2*BSIZE);
-
-  // loop through all inodes
-  for (i = 0; i < ninodes; i++, node++) {
-    if (node->type != T_DIR)
-      continue;
-
-    // look through all blocks (direct and indirect) of current inode
-    for (j = 0; j <= NDIRECT; j++) {
-      b_addr = node->addrs[j];
-      if (b_addr == 0) // address not in use
-	continue;
-
-      d_entry = (struct dirent *) (mem_start + b_addr*BSIZE);
-      // loop through all dirents in current block
-      for (k = 0; k < DPB; k++, d_entry++) {
-        if (strcmp(d_entry->name, "..") == 0) {
-	  found = 0;
-	  n = 0;
-	  while (n < ninodes) {
-            //m = in_use_inums[n];
-	    if (in_use_inums[n] == 0) {
-	      n++;
-	      continue;
-	    }
-            if (d_entry->inum == n) {
-	      found = 1;
-	      break;
-	    }
-            n++;
-	  }
-          if (!found)
-	    return -1;
-	}
-      }
+  while ((data = lseek(fd, data, SEEK_DATA)) >= 0) {
+    if ((uint64_t) data >= len)
+      break;
+    if ((hole = lseek(fd, data, SEEK_HOLE)) < 0)
+      goto all_data;
+    if (n == cap) {
+      cap = cap ? 2*cap : 64;
+      if ((more = realloc(e, cap*sizeof(struct extent))) == NULL)
+        die();
+      e = more;
     }
+    e[n++] = (struct extent) { data, ((uint64_t) hole < len) ?
+                                     (uint64_t) hole : len };
+    data = hole;
   }
-  return 0;
+  if ((data < 0) && (errno != ENXIO)) // no data past data, or no SEEK_DATA
+    goto all_data;
+  if ((n == 1) && (e[0].start == 0) && (e[0].end == len))
+    goto all_data;
+  img->extents = (e != NULL) ? e : malloc(sizeof(struct extent));
+  if (img->extents == NULL)
+    die();
+  img->nextents = n;
+  return;
+
+ all_data:
+  free(e);
 }
 
-// helper for extra check #2
-int recurse_dir(void *mem_start, struct dinode *node, int *circle) {
-  struct dinode *new_node;
-  uint b_addr;
-  struct dirent *d_entry;
-  int i, j, k, check, size;
-  size = sizeof(struct dinode);
+// the first extent of img ending past byte off, or nextents if there is none
+uint next_extent(struct image *img, uint64_t off) {
+  uint lo = 0, hi = img->nextents, mid;
 
-  for (i = 0; i < NDIRECT; i++) {
-    b_addr = node->addrs[i];
-    if (b_addr == 0)
-      continue;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (img->extents[mid].end <= off)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
 
-    d_entry = (struct dirent *) (mem_start + b_addr*BSIZE);
-    for (j = 0; j < DPB; j++, d_entry++) {
-      if (d_entry->inum == 0)
-        continue;
+// whether the n blocks from b lie wholly in holes of a sparse image
+int in_hole(struct image *img, uint b, uint n) {
+  uint64_t off = (uint64_t) b*img->bsize;
+  uint k;
 
-      if (strcmp(d_entry->name, "..") != 0)
-        continue;
+  if (img->extents == NULL)
+    return 0;
+  k = next_extent(img, off);
+  return (k == img->nextents) ||
+         (img->extents[k].start >= off + (uint64_t) n*img->bsize);
+}
 
-      if (d_entry->inum == 1)
-	continue;
+// helper for pread_blocks
+// read len bytes at off into buf with pread; returns how many there were
+// before the end of the image
+size_t pread_range(struct image *img, char *buf, size_t len, uint64_t off) {
+  size_t got = 0;
+  ssize_t rc;
 
-      k = 0;
-      while (circle[k] != 0) {
-        if (d_entry->inum == circle[k])
-	  return -1;
-	k++;
-      }
-      circle[k] = d_entry->inum;
+  while (got < len) {
+    rc = pread(img->fd, buf + got, len - got, (off_t) (off + got));
+    if (rc < 0)
+      die();
+    if (rc == 0)
+      break;
+    got += rc;
+  }
+  __atomic_fetch_add(&img->bytes_read, got, __ATOMIC_RELAXED);
+  return got;
+}
 
-      new_node =
-	(struct dinode *) (mem_start + 2*BSIZE + (d_entry->inum)*size);
-      check = recurse_dir(mem_start, new_node, circle);
-      
-      if (check == -1)
-	return -1;
-    }
+// read n blocks starting at b into buf with pread; blocks past the end of
+// the image read as zeros, and so do the holes of a sparse image, which are
+// not read
+void pread_blocks(struct image *img, uint b, uint n, void *buf) {
+  uint64_t off = (uint64_t) b*img->bsize, lo, hi;
+  size_t want = (size_t) n*img->bsize, got;
+
+  if (img->extents == NULL) {
+    got = pread_range(img, buf, want, off);
+    memset((char *) buf + got, 0, want - got);
+    return;
+  }
+  memset(buf, 0, want);
+  for (uint k = next_extent(img, off);
+       (k < img->nextents) && (img->extents[k].start < off + want); k++) {
+    lo = (img->extents[k].start > off) ? img->extents[k].start : off;
+    hi = (img->extents[k].end < off + want) ? img->extents[k].end :
+                                              off + want;
+    pread_range(img, (char *) buf + (lo - off), hi - lo, lo);
   }
-  return 0;
 }
 
-// extra check #2
-int check_no_loops(void *mem_start, int ninodes) {
-  struct dinode *node = (struct dinode *) (mem_start + 2*BSIZE);
-  int *dir_circle;
-  dir_circle = calloc(ninodes, sizeof(int));
-  int i, check;
+// entry k of shard s
+struct cache_entry *shard_entry(struct cache_shard *s, int k) {
+  return (struct cache_entry *) (s->entries + (size_t) k*s->esize);
+}
 
-  for (i = 0; i < ninodes; i++, node++) {
-    dir_circle = calloc(ninodes, sizeof(int));
-    if (node->type != T_DIR)
-      continue;
-    
-    check = recurse_dir(mem_start, node, dir_circle);
+// a cache holding at most cache_mb megabytes of blocks of bsize bytes
+struct block_cache *cache_create(uint cache_mb, uint bsize) {
+  struct block_cache *cache;
+  size_t esize = (sizeof(struct cache_entry) + bsize + 3) & ~(size_t) 3;
+  uint64_t total = ((uint64_t) cache_mb << 20) / esize;
+  uint per_shard = total / NSHARDS;
 
-    if (check == -1) {
-      free(dir_circle);
-      return -1;
-    }
+  if (per_shard < 8) // a few blocks per shard, whatever the limit
+    per_shard = 8;
+  if ((cache = calloc(1, sizeof(struct block_cache))) == NULL)
+    die();
+  for (int i = 0; i < NSHARDS; i++) {
+    struct cache_shard *s = &cache->shards[i];
+    pthread_mutex_init(&s->lock, NULL);
+    s->nentries = per_shard;
+    s->esize = esize;
+    if ((s->entries = calloc(per_shard, esize)) == NULL)
+      die();
+    if ((s->buckets = malloc(per_shard*sizeof(int))) == NULL)
+      die();
+    memset(s->buckets, -1, per_shard*sizeof(int));
+  }
+  return cache;
+}
 
-    free(dir_circle);
+void cache_free(struct block_cache *cache) {
+  if (cache == NULL)
+    return;
+  for (int i = 0; i < NSHARDS; i++) {
+    pthread_mutex_destroy(&cache->shards[i].lock);
+    free(cache->shards[i].entries);
+    free(cache->shards[i].buckets);
   }
-  return 0;
+  free(cache);
 }
 
-// extra repair checks
-void repair(void *mem_start, struct dinode *node, int ninodes) {
-  if ((in_use_inums = calloc(ninodes, sizeof(int))) < 0)
-    exit(1);
-  get_inode_info(mem_start, ninodes);
+// helper for the cache
+// the entry of shard s holding block b, or NULL; s is locked
+struct cache_entry *cache_find(struct cache_shard *s, uint b) {
+  struct cache_entry *e;
 
-  struct dirent *d_entry;
-  uint b_addr;
-  struct dinode *lost_found =
-	  (struct dinode *) (mem_start + 2*BSIZE + 29*sizeof(struct dinode));
-
-  node = (struct dinode *) (mem_start +  2*BSIZE);
-  int i, j, k, found;
-
-  for (i = 0; i < ninodes; i++, node++) {
-    if (i < 2)
-      continue;
-
-    if ((node->type != 0) && (in_use_inums[i] == 0)) {
-      for (j = 0; j < NDIRECT; j++) {
-	b_addr = lost_found->addrs[j];
-
-	found = 0;
-	d_entry = (struct dirent *) (mem_start + b_addr*BSIZE);
-        for (k = 0; k < DPB; k++, d_entry++) {
-          if (d_entry->inum == 0) {
-            d_entry->inum = i;
-	    found = 1;
-	    break;
-	  }
-	}
-	if (found)
-	  break;
-      }
-    }
+  for (int k = s->buckets[(b / NSHARDS) % s->nentries]; k >= 0; k = e->next) {
+    e = shard_entry(s, k);
+    if (e->block == b)
+      return e;
   }
-  free(in_use_inums);
+  return NULL;
 }
 
+// helper for the cache
+// evict the first entry not referenced since the hand passed it, and hand
+// it out for block b; s is locked
+struct cache_entry *cache_evict(struct cache_shard *s, uint b) {
+  int bucket = (b / NSHARDS) % s->nentries;
+  struct cache_entry *e;
+  int *link;
 
-int main(int argc, char *argv[]) {
-  if ((argc < 2) || (argc > 3)) {
-    fprintf(stderr, "Usage: xv6_fsck <file_system_image>.\n");
-    exit(1);
+  while (shard_entry(s, s->hand)->used && shard_entry(s, s->hand)->ref) {
+    shard_entry(s, s->hand)->ref = 0;
+    s->hand = (s->hand + 1) % s->nentries;
   }
+  int victim = s->hand;
+  s->hand = (s->hand + 1) % s->nentries;
+  e = shard_entry(s, victim);
 
-  int rc;
-  struct stat sbuf;
-  void *img_ptr;
-  struct superblock *sb;
-  struct dinode *dip;
+  if (e->used) { // unlink from its old chain
+    link = &s->buckets[(e->block / NSHARDS) % s->nentries];
+    while (*link != victim)
+      link = &shard_entry(s, *link)->next;
+    *link = e->next;
+  }
+  e->block = b;
+  e->used = 1;
+  e->ref = 1;
+  e->next = s->buckets[bucket];
+  s->buckets[bucket] = victim;
+  return e;
+}
 
-  if ((argc == 3) && (strcmp(argv[1], "-r") == 0))
-    goto repair;
-  else if (argc == 3)
-    exit(1);
+// copy block b into buf, reading it into the cache on a miss
+void cache_read(struct image *img, uint b, void *buf) {
+  struct cache_shard *s = &img->cache->shards[b % NSHARDS];
+  struct cache_entry *e;
 
-  int fd = open(argv[1], O_RDONLY);
-  if (fd < 0) {
-    fprintf(stderr, "image not found.\n");
-    exit(1);
+  pthread_mutex_lock(&s->lock);
+  if ((e = cache_find(s, b)) != NULL) { // hit
+    e->ref = 1;
+    s->hits++;
+  } else {
+    e = cache_evict(s, b);
+    pread_blocks(img, b, 1, e->data);
+    s->misses++;
   }
+  memcpy(buf, e->data, img->bsize);
+  pthread_mutex_unlock(&s->lock);
+}
 
-  //int rc;
-  //struct stat sbuf;
-  rc = fstat(fd, &sbuf);
-  if (rc != 0)
-    exit(1);
+// put block b, read elsewhere into data, in the cache
+void cache_insert(struct image *img, uint b, void *data) {
+  struct cache_shard *s = &img->cache->shards[b % NSHARDS];
 
-  img_ptr = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-  if (img_ptr == MAP_FAILED)
-    exit(1);
-  if (close(fd) < 0)
-    exit(1);
-  
-  sb = (struct superblock *) (img_ptr + BSIZE);
-  dip = (struct dinode *) (img_ptr + (2*BSIZE));
-  uint db1 = ((sb->ninodes / IPB) + 1) + ((sb->size / BPB) + 1) + 2;
-  int i, failed;
-  failed = 0;
+  pthread_mutex_lock(&s->lock);
+  if (cache_find(s, b) == NULL)
+    memcpy(cache_evict(s, b)->data, data, img->bsize);
+  pthread_mutex_unlock(&s->lock);
+}
 
-  for (i = 0; i < sb->ninodes; i++, dip++) {
-    if (dip->type == 0) // unallocated inode, skip
-      continue;
+// block b of the image; buf holds a block and is only written to when the
+// image is not mapped
+void *read_block(struct image *img, uint b, void *buf) {
+  if (in_hole(img, b, 1))
+    return (void *) zeros;
+  if (img->mem != NULL)
+    return img->mem + (size_t) b*img->bsize;
+  cache_read(img, b, buf);
+  return buf;
+}
 
-    // check #1
-    // each inode is either unallocated or a valid type
-    if (check_valid_inodes(dip->type) < 0) {
-      fprintf(stderr, "ERROR: bad inode.\n");
-      failed = 1;
-      goto clean_and_exit;
-    }
+// n consecutive blocks starting at b, bypassing the cache; used for the
+// inode table and the bitmap, which are read once, in order
+void *read_blocks(struct image *img, uint b, uint n, void *buf) {
+  if ((n <= ZERO_BLOCKS) && in_hole(img, b, n))
+    return (void *) zeros;
+  if (img->mem != NULL)
+    return img->mem + (size_t) b*img->bsize;
+  pread_blocks(img, b, n, buf);
+  return buf;
+}
 
-    // check #2A
-    // each address used by direct block in inode is valid
-    if (check_valid_direct(dip, sb->size) < 0) {
-      fprintf(stderr, "ERROR: bad direct address in inode.\n");
-      failed = 1;
-      goto clean_and_exit;
-    }
+// a copy of inode inum
+void read_inode(struct image *img,
+                struct superblock *sb,
+                uint inum,
+                struct dinode *node) {
+  union block buf;
+  struct dinode *dip = read_blocks(img, IBLOCK(inum, sb), 1, &buf);
+  *node = dip[inum % IPB(sb->bsize)];
+}
 
-    // check #2B
-    // each address used by indirect block in inode is valid
-    if (check_valid_indirect(img_ptr, dip, sb->size) < 0) {
-      fprintf(stderr, "ERROR: bad indirect address in inode.\n");
-      failed = 1;
-      goto clean_and_exit;
-    }
+// the superblock of an image of len bytes (0 when not known), in whichever
+// layout it is, and img->bsize set to match; a RISC-V superblock starts
+// with FSMAGIC at byte 1024, and a log one names block 2 as the start of the
+// log and the inode table after it, which a v6 one leaves zero. What is not
+// in the superblock is worked out the way mkfs lays out the image
+void read_superblock(struct image *img, uint64_t len, struct superblock *sb) {
+  union block buf;
+  uint *w;
 
-    // check #3
-    // root directory exists, inode number is 1, parent of root is self
-    if (i == 1) {
-      if ((dip->type != T_DIR) || (check_valid_dir(img_ptr, dip, i) < 0)) {
-        fprintf(stderr, "ERROR: root directory does not exist.\n");
-        failed = 1;
-	goto clean_and_exit;
-      }
+  memset(sb, 0, sizeof(struct superblock));
+  img->bsize = BSIZE;
+  if ((len == 0) || (len >= 3*BSIZE)) {
+    w = read_blocks(img, 2, 1, &buf);
+    if (w[0] == FSMAGIC) {
+      memcpy(sb, w + 1, 7*sizeof(uint));
+      sb->layout = LAYOUT_RISCV;
+      sb->bsize = MAXBSIZE;
     }
-    // check #4
-    // each directory contsin . and .., . points to directory itself
-    if ((dip->type == T_DIR) && (check_valid_dir(img_ptr, dip, i) < 0)) {
-      fprintf(stderr, "ERROR: directory not properly formatted.\n");
-      failed = 1;
-      goto clean_and_exit;
-    }
-    
-    // check #5
-    // for in-use inodes, each address in use is also marked in use in bitmap
-    if ((check_valid_bitmap(img_ptr, dip, sb->ninodes, i)) < 0) {
-      fprintf(stderr,
-              "ERROR: address used by inode but marked free in bitmap.\n");
-      failed = 1;  
-      goto clean_and_exit;
-    } 
   }
-
-  if ((used_datablocks = calloc(sb->nblocks, sizeof(int))) == NULL)
-    exit(1);
-
-  // check #6
-  // for blocks marked in-use in bitmap, actually is in-use somewhere
-  if (check_valid_blocks_in_bitmap(img_ptr, sb, db1) < 0) {
-    fprintf(stderr, "ERROR: bitmap marks block in use but it is not in use.\n");
-    failed = 1;
-    goto clean_and_exit;
+  if ((sb->bsize == 0) && ((len == 0) || (len >= 2*BSIZE))) {
+    w = read_blocks(img, 1, 1, &buf);
+    memcpy(sb, w, 7*sizeof(uint));
+    sb->bsize = BSIZE;
+    sb->layout = LAYOUT_LOG;
+    if ((sb->logstart != 2) ||
+        ((uint64_t) sb->inodestart < 2 + (uint64_t) sb->nlog) ||
+        (sb->bmapstart <= sb->inodestart))
+      sb->layout = LAYOUT_V6;
   }
-
-  // check #7
-  // for in-use inodes, direct address in use is only used once
-  if (check_direct_addr_use(img_ptr, sb->ninodes) < 0) {
-    fprintf(stderr, "ERROR: direct address used more than once.\n");
-    failed = 1;
-    goto clean_and_exit;
+  if (sb->layout == LAYOUT_V6) {
+    sb->bsize = BSIZE;
+    sb->nlog = sb->logstart = 0;
+    sb->inodestart = 2;
+    sb->bmapstart = sb->ninodes / IPB(BSIZE) + 3;
+    // the checks have always taken nblocks as the end of the data blocks
+    sb->dataend = sb->nblocks;
+  } else {
+    uint64_t end = (uint64_t) sb->bmapstart + sb->size / BPB(sb->bsize) + 1 +
+                   sb->nblocks;
+    sb->dataend = (end < 0xffffffffu) ? end : 0xffffffffu;
   }
+  img->bsize = sb->bsize;
+}
 
-  // check #8
-  // for in-use inodes, indirect address in use is only used once
-  if (check_indirect_addr_use(img_ptr, sb->ninodes) < 0) {
-    fprintf(stderr, "ERROR: indirect address used more than once.\n");
-    failed = 1;
-    goto clean_and_exit;
-  }
+// scratch memory
+// everything the checks of one image need is taken from a single arena,
+// given a size worked out from the superblock (scratch_size) and handed out
+// like a stack: a phase notes the mark, allocates, and releases back to the
+// mark when done so the next phase reuses the space. The mapping is kept for
+// the next image the thread checks, and only made again when that one needs
+// more
+struct arena {
+  char *base;
+  size_t size;   // the image's share of the mapping
+  size_t mapped;
+  size_t used;
+  size_t dirty;  // high-water mark, space above it is still zero
+  size_t peak;   // the most of size used, for --stats
+};
 
-  if ((in_use_inums = calloc(sb->ninodes, sizeof(int))) < 0)
-    exit(1);
-  get_inode_info(img_ptr, sb->ninodes);
-
-  dip = (struct dinode *) (img_ptr + (2*BSIZE));
-  for (i = 0; i < sb->ninodes; i++, dip++) {
-    if (i < 2)
-     continue;
-
-    // check #9
-    // inode marked in use must be referred to in at least one directory
-    if ((dip->type != 0) && (in_use_inums[i] == 0)) {
-      fprintf(stderr,
-	      "ERROR: inode marked use but not found in a directory.\n");
-      failed = 1;
-      goto clean_and_exit;
-    }
+__thread struct arena scratch; // of the image this thread checks
 
-    // check #10
-    // all inodes referred to in valid director are actually in use
-    if ((in_use_inums[i] != 0) && (dip->type == 0)) {
-      fprintf(stderr,
-	      "ERROR: inode referred to in directory but marked free.\n");
-      failed = 1;
-      goto clean_and_exit;
-    }
-    // check #11
-    // reference counts for regular files match number of times
-    // file is referred to in directories
-    if ((dip->type == T_FILE) && (dip->nlink != in_use_inums[i])) {
-      fprintf(stderr,
-	      "ERROR: bad reference count for file.\n");
-      failed = 1;
-      goto clean_and_exit;
-    }
-    // check #12
-    // each directory only appears in one other directory
-    if ((dip->type == T_DIR) && (in_use_inums[i] > 1)) {
-      fprintf(stderr,
-	      "ERROR: directory appears more than once in file system.\n");
-      failed = 1;
-      goto clean_and_exit;
+// every allocation is rounded up to a cache line
+#define ARENA_ROUND(n) (((size_t) (n) + 63) & ~(size_t) 63)
+
+void arena_free(void) {
+  if (munmap(scratch.base, scratch.mapped ? scratch.mapped : 64) < 0)
+    die();
+  scratch = (struct arena) { 0 };
+}
+
+void arena_init(size_t size) {
+  size = ARENA_ROUND(size);
+  if ((scratch.base == NULL) || (size > scratch.mapped)) {
+    if (scratch.base != NULL)
+      arena_free();
+    // pages are only backed once touched, so the reservation costs nothing
+    scratch.base = mmap(NULL, size ? size : 64, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (scratch.base == MAP_FAILED) {
+      scratch = (struct arena) { 0 };
+      die();
     }
+    scratch.mapped = size;
   }
+  scratch.size = size;
+  scratch.used = scratch.peak = 0;
+}
 
-  // EXTRA TESTS
+// n zeroed bytes
+void *arena_alloc(size_t n) {
+  char *p = scratch.base + scratch.used;
+  n = ARENA_ROUND(n);
+  if (n > scratch.size - scratch.used) // scratch_size missed an allocation
+    die();
+  if (scratch.used < scratch.dirty)
+    memset(p, 0, (n < scratch.dirty - scratch.used) ?
+                 n : scratch.dirty - scratch.used);
+  scratch.used += n;
+  if (scratch.used > scratch.dirty)
+    scratch.dirty = scratch.used;
+  if (scratch.used > scratch.peak)
+    scratch.peak = scratch.used;
+  return p;
+}
 
-  // check #E1
-  // each .. entry in directory points to proper parent inode
-  // and parent inode points back to it
-  if (check_parent_dir(img_ptr, sb->ninodes) < 0) {
-    fprintf(stderr, "ERROR: parent directory mismatch.\n");
-    failed = 1;
-    goto clean_and_exit;
-  }
+size_t arena_mark(void) {
+  return scratch.used;
+}
 
-  // check #E2
-  // no loops in directory tree
-  if (check_no_loops(img_ptr, sb->ninodes) < 0) {
-    fprintf(stderr, "ERROR: inaccessible directory exists.\n");
-    failed = 1;
-    goto clean_and_exit;
-  }
+void arena_release(size_t mark) {
+  scratch.used = mark;
+}
 
- clean_and_exit: ;
-  free(in_use_inums);
-  free(used_datablocks);
-  if (munmap(img_ptr, sbuf.st_size) < 0)
-    exit(1);
-  
-  if (failed)
-    exit(1);
+// per-inode summary kept by the single pass over the inode table, so the
+// later checks never have to walk the inode table again
+struct inode_info {
+  short type;
+  short nlink;
+  uint dd_start; // index of first .. entry in scan.dotdots
+  uint dd_count; // number of .. entries found in direct directory blocks
+  uint parent;   // directory whose entry names this inode
+  uint dotdot;   // inum every .. entry of this directory names
+};
 
-  return 0;
+// dotdot of a directory whose .. entries disagree or name no inode
+#define BAD_DOTDOT ((uint) -1)
 
-  // repair image
- repair: ;
-  fd = open(argv[2], O_RDWR);
-  if (fd < 0) {
-    fprintf(stderr, "image not found.\n");
-    exit(1);
-  }
+__thread struct inode_info *inode_infos;
+
+// result of each check, in the order the checks are performed
+enum {
+  OK,
+  BAD_SUPERBLOCK,    // check #0
+  BAD_INODE,         // check #1
+  BAD_DIRECT,        // check #2A
+  BAD_INDIRECT,      // check #2B
+  NO_ROOT,           // check #3
+  BAD_DIR,           // check #4
+  BITMAP_FREE,       // check #5
+  BITMAP_UNUSED,     // check #6
+  DIRECT_REUSED,     // check #7
+  INDIRECT_REUSED,   // check #8
+  NOT_IN_DIR,        // check #9
+  REF_FREE,          // check #10
+  BAD_REFCOUNT,      // check #11
+  DIR_REPEATED,      // check #12
+  BAD_PARENT,        // extra check #1
+  UNREACHABLE_DIR    // extra check #2
+};
+
+char *errors[] = {
+  [BAD_SUPERBLOCK] = "ERROR: bad superblock.\n",
+  [BAD_INODE] = "ERROR: bad inode.\n",
+  [BAD_DIRECT] = "ERROR: bad direct address in inode.\n",
+  [BAD_INDIRECT] = "ERROR: bad indirect address in inode.\n",
+  [NO_ROOT] = "ERROR: root directory does not exist.\n",
+  [BAD_DIR] = "ERROR: directory not properly formatted.\n",
+  [BITMAP_FREE] = "ERROR: address used by inode but marked free in bitmap.\n",
+  [BITMAP_UNUSED] = "ERROR: bitmap marks block in use but it is not in use.\n",
+  [DIRECT_REUSED] = "ERROR: direct address used more than once.\n",
+  [INDIRECT_REUSED] = "ERROR: indirect address used more than once.\n",
+  [NOT_IN_DIR] = "ERROR: inode marked use but not found in a directory.\n",
+  [REF_FREE] = "ERROR: inode referred to in directory but marked free.\n",
+  [BAD_REFCOUNT] = "ERROR: bad reference count for file.\n",
+  [DIR_REPEATED] = "ERROR: directory appears more than once in file system.\n",
+  [BAD_PARENT] = "ERROR: parent directory mismatch.\n",
+  [UNREACHABLE_DIR] = "ERROR: inaccessible directory exists.\n"
+};
+
+// name of each check in the --all report
+char *check_ids[] = {
+  [BAD_SUPERBLOCK] = "0",
+  [BAD_INODE] = "1",
+  [BAD_DIRECT] = "2A",
+  [BAD_INDIRECT] = "2B",
+  [NO_ROOT] = "3",
+  [BAD_DIR] = "4",
+  [BITMAP_FREE] = "5",
+  [BITMAP_UNUSED] = "6",
+  [DIRECT_REUSED] = "7",
+  [INDIRECT_REUSED] = "8",
+  [NOT_IN_DIR] = "9",
+  [REF_FREE] = "10",
+  [BAD_REFCOUNT] = "11",
+  [DIR_REPEATED] = "12",
+  [BAD_PARENT] = "E1",
+  [UNREACHABLE_DIR] = "E2"
+};
+
+// a field of a violation that does not apply
+#define NONE ((uint) -1)
+
+// one violation found by --all
+struct violation {
+  int err;
+  uint inum;   // inode at fault
+  uint block;  // block at fault, or holding the dirent at fault
+  int offset;  // byte offset of that dirent in block, or -1
+  uint other;  // the other inode involved, see report_write
+};
+
+// violations found by --all; only the first cap are kept, the rest counted,
+// and once stop are found (if not 0) no more are looked for
+struct report {
+  struct violation *v;
+  uint n, cap;
+  uint64_t total;
+  uint64_t stop;
+  struct image *img;       // with graph, to name inodes by their paths
+  struct superblock *sb;
+  struct dir_graph *graph; // or NULL
+};
+
+int report_full(struct report *rep) {
+  return (rep->stop != 0) && (rep->total >= rep->stop);
+}
+
+void report_add(struct report *rep,
+                int err,
+                uint inum,
+                uint block,
+                int offset,
+                uint other) {
+  if (report_full(rep))
+    return;
+  rep->total++;
+  if (rep->n == rep->cap)
+    return;
+  rep->v[rep->n++] = (struct violation) { err, inum, block, offset, other };
+}
+
+// owners of a block, as inum + 1 so that 0 means unowned; direct and
+// indirect addresses are tracked apart since checks #7 and #8 are separate
+struct block_owner {
+  int direct;
+  int indirect;
+};
+
+// first block found with two owners
+struct dup_addr {
+  int found;
+  uint block;
+  int inum[2];
+};
+
+// result of reconciling the blocks in use with the on-disk bitmap
+struct bitmap_summary {
+  uint64_t used;         // blocks in use by some inode
+  uint64_t free;         // data blocks marked free
+  uint64_t leaked;       // check #6, data blocks marked in use but not in use
+  uint64_t missing;      // check #5, blocks in use but marked free
+  uint64_t first_leaked;
+};
+
+// incremental mode: what an inode contributes to the state checks #5-12, E1
+// and E2 are decided from, so it can be taken out again once it changes
+enum {
+  F_DIRECT,   // a direct address
+  F_INDIRECT, // an address in the indirect block
+  F_IBLOCK,   // the indirect block itself
+  F_NAME,     // a dirent other than . and .. naming value
+  F_DOTDOT    // a .. entry in a direct block naming value, when over 1
+};
+
+struct fact {
+  uint kind;
+  uint inum;
+  uint value; // a block, or the inum a dirent names
+};
+
+struct fact_log {
+  struct fact *f;
+  uint64_t n, cap;
+};
+
+void log_fact(struct fact_log *log, uint kind, uint inum, uint value) {
+  if (log->n == log->cap) {
+    log->cap = log->cap ? 2*log->cap : 1024;
+    if ((log->f = realloc(log->f, log->cap*sizeof(struct fact))) == NULL)
+      die();
+  }
+  log->f[log->n++] = (struct fact) { kind, inum, value };
+}
+
+// one entry of a directory other than ., as an edge of the directory graph
+struct dir_edge {
+  uint child;    // inum the entry names
+  uint block;    // block holding the entry
+  ushort off;    // byte offset of the entry in block
+  ushort dotdot; // the entry is named ..
+};
+
+// an edge as a scan finds it, before the graph is put together
+struct found_edge {
+  uint parent;
+  struct dir_edge e;
+};
+
+// every directory entry of the image other than ., in compressed sparse rows:
+// the entries of directory i, in the order they come in its blocks, are
+// edge[row[i]] up to edge[row[i + 1]]. Checks #10-12, E1, --all and repair
+// look entries up here rather than reading the directory blocks again
+struct dir_graph {
+  uint *row;     // ninodes + 1 of them, or NULL when there is no graph
+  uint *namer;   // first named entry naming each inum, or NONE; an inode's
+                 // path is built from these, found the first time one is
+  struct dir_edge *edge;
+  uint nedges;
+};
+
+// how far the checks go, each tier running the checks of the one below it
+// and more: quick checks #0-6, standard #7-12 as well, thorough (the
+// default) E1 and E2 too. A scan keeps only the records its tier needs
+enum { TIER_THOROUGH, TIER_STANDARD, TIER_QUICK };
+
+// state gathered by the single pass for checks needing every inode; each
+// thread scanning the inode table has its own, merged once all are done
+struct scan {
+  int tier;              // TIER_*, the checks the records are kept for
+  int partitioned;       // --memory-limit, records for checks #7-12 are
+                         // left to passes of their own
+  char *bm;              // on-disk bitmap
+  uint64_t *used;        // check #6, blocks in use, packed like bm
+  uint64_t *used_addrs;  // check #5, blocks in use other than indirect blocks
+  struct bitmap_summary bits;
+  int checks_1_4_ok;     // checks #1-4 passed for every inode, as a repair
+                         // needs whatever check #5 found
+  uint bad_inum;         // where check #5 failed
+  uint bad_block;
+  int *refs;             // checks #9-12, directory entries naming each inum,
+                         // or NULL for a quick scan
+  struct block_owner *owners; // checks #7 and #8, shared by all threads, or
+                              // NULL for a quick scan
+  struct dup_addr direct_dup;
+  struct dup_addr indirect_dup;
+  ushort *dotdots;       // extra check #2, .. entries of every directory
+  uint ndotdots;
+  uint dotdots_cap;
+  struct found_edge *found; // entries for the directory graph, not kept by
+  uint nfound;              // incremental mode
+  uint found_cap;
+  struct dir_graph graph;   // put together from found once the scan is done
+  uint64_t inodes;       // --stats, in-use inodes visited
+  uint64_t dirent_blocks;
+  uint64_t indirect_blocks;
+  struct fact_log *facts; // incremental mode, or NULL
+};
+
+// check #1
+int check_valid_inodes(int type) {
+  switch(type) {
+    case T_DIR :
+      break;
+    case T_FILE :
+      break;
+    case T_DEV :
+      break;
+    default : // non-standard type, error
+      return -1;
+  }
+  return 0;
+}
+
+// check #2A
+int check_valid_direct(struct dinode *node, int size) {
+  uint b_addr;
+  for (int i = 0; i < NDIRECT; i++) { // loop through all direct blocks
+    b_addr = node->addrs[i];
+    if (b_addr == 0) // address not in use
+      continue;
+
+    // address outside of possible address space, error
+    if ((b_addr < 0) || (b_addr >= size))
+      return -1;
+  }
+  return 0;
+}
+
+// check #2B
+// on success, *i_block is set to the inode's indirect block (or NULL), read
+// into buf if need be, so the remaining checks do not have to read it again
+PER_BSIZE
+int check_valid_indirect(struct image *img,
+                         struct dinode *node,
+                         int size,
+                         union block *buf,
+                         uint **i_block,
+                         uint bsize) {
+  uint b_addr = node->addrs[NDIRECT];
+  *i_block = NULL;
+  if (b_addr == 0) // address not in use
+    return 0;
+  // address outside of possible address space, error
+  else if ((b_addr < 0) || (b_addr >= size))
+    return -1;
+
+  uint *addr = read_block(img, b_addr, buf);
+  // loop through indirect blocks
+  for (int i = 0; i < NINDIRECT(bsize); i++) {
+    b_addr = addr[i];
+    if (b_addr == 0) // address not in use
+      continue;
+
+    // address outside of possible address space, error
+    if ((b_addr < 0) || (b_addr >= size))
+      return -1;
+  }
+
+  *i_block = addr;
+  return 0;
+}
+
+// helper for the directory graph
+// room for n more entries
+void reserve_edges(struct scan *sc, uint n) {
+  if (sc->nfound + n <= sc->found_cap)
+    return;
+  while (sc->nfound + n > sc->found_cap)
+    sc->found_cap = sc->found_cap ? 2*sc->found_cap : 1024;
+  sc->found = realloc(sc->found, sc->found_cap*sizeof(struct found_edge));
+  if (sc->found == NULL)
+    die();
+}
+
+// helper for extra check #1
+// note the inum the .. entries of a group of entries of directory info name,
+// or BAD_DOTDOT if they disagree
+void note_dotdots(struct inode_info *info,
+                  struct dirent *block,
+                  struct dirent_kinds *k,
+                  int ninodes) {
+  ushort child;
+
+  for (uint32_t m = k->dotdot; m != 0; m &= m - 1) {
+    child = block[__builtin_ctz(m)].inum;
+    if ((child == 0) || (child >= ninodes))
+      info->dotdot = BAD_DOTDOT; // cannot name an in-use directory
+    else if (info->dotdot == 0)
+      info->dotdot = child;
+    else if (info->dotdot != child)
+      info->dotdot = BAD_DOTDOT;
+  }
+}
+
+// helper for checks #9-12 and extra check #1
+// count_dirents for a block of directory inum already classified as k, also
+// noting inum as the parent of every inode it names and the inum its ..
+// entries name; block is the group of entries starting first bytes into
+// directory block b_addr
+void scan_dirents(struct dirent *block,
+                  struct dirent_kinds *k,
+                  int inum,
+                  int ninodes,
+                  uint b_addr,
+                  uint first,
+                  struct scan *sc) {
+  uint32_t m;
+  ushort child;
+
+  // every entry but ., even a .. naming inum 0, which E1 reports
+  if (sc->facts == NULL) {
+    struct found_edge *f;
+    reserve_edges(sc, DGROUP);
+    f = sc->found + sc->nfound;
+    for (m = (k->used | k->dotdot) & ~k->dot; m != 0; m &= m - 1, f++) {
+      uint j = __builtin_ctz(m);
+      *f = (struct found_edge) { inum, { block[j].inum, b_addr,
+                                         first + j*sizeof(struct dirent),
+                                         (k->dotdot >> j) & 1 } };
+    }
+    sc->nfound = f - sc->found;
+  }
+
+  note_dotdots(&inode_infos[inum], block, k, ninodes);
+
+  for (m = k->used & ~(k->dot | k->dotdot); m != 0; m &= m - 1) {
+    child = block[__builtin_ctz(m)].inum;
+    if (child >= ninodes)
+      continue;
+    sc->refs[child]++; // increment current inum count
+    if (sc->facts != NULL)
+      log_fact(sc->facts, F_NAME, inum, child);
+    // another thread may be naming the same inode, a repeat check #12 fails
+    __atomic_store_n(&inode_infos[child].parent, inum, __ATOMIC_RELAXED);
+  }
+}
+
+// helper for extra check #2
+void add_dotdot(struct scan *sc, ushort inum) {
+  if (sc->ndotdots == sc->dotdots_cap) {
+    sc->dotdots_cap = sc->dotdots_cap ? 2*sc->dotdots_cap : 1024;
+    sc->dotdots = realloc(sc->dotdots, sc->dotdots_cap*sizeof(ushort));
+    if (sc->dotdots == NULL)
+      die();
+  }
+  sc->dotdots[sc->ndotdots++] = inum;
+}
+
+// check #3 and #4
+// every block of the directory is read exactly once: direct blocks decide
+// checks #3 and #4 and the .. entries for E2 and, together with the indirect
+// data blocks, feed the reference counts for checks #9-12 and E1
+PER_BSIZE
+int check_valid_dir(struct image *img,
+                    struct dinode *node,
+                    uint *i_block,
+                    int inum,
+                    int ninodes,
+                    struct scan *sc,
+                    uint bsize) {
+  uint b_addr;
+  union block buf;
+  struct dirent *dirents, *block, *d_entry;
+  struct dirent_kinds kinds;
+  int cd, pd; // used for tracking current directory and parent directory
+  int rc, done;
+  cd = pd = done = 0;
+  rc = -1; // current and/or parent directory not found, error
+
+  inode_infos[inum].dd_start = sc->ndotdots;
+
+  // loop through all direct blocks
+  for (int i = 0; i < NDIRECT; i++) {
+    b_addr = node->addrs[i];
+    if (b_addr == 0) // address not in use
+      continue;
+
+    dirents = read_block(img, b_addr, &buf);
+    sc->dirent_blocks++;
+    // a group of DGROUP entries at a time
+    for (block = dirents; block < dirents + DPB(bsize); block += DGROUP) {
+      classify_dirents(block, &kinds);
+      // loop through the . and .. dirents in block, no others move the checks
+      for (uint32_t m = kinds.dot | kinds.dotdot; m != 0; m &= m - 1) {
+        d_entry = &block[__builtin_ctz(m)];
+        if (kinds.dot & m & -m) { // found current directory
+          if (!done) {
+            cd = 1;
+            if (d_entry->inum != inum) // cd not properly numbered, error
+              done = 1;
+          }
+        } else { // found parent directory
+          if ((d_entry->inum > 1) && (sc->tier == TIER_THOROUGH)) {
+            add_dotdot(sc, d_entry->inum);
+            inode_infos[inum].dd_count++;
+            if (sc->facts != NULL)
+              log_fact(sc->facts, F_DOTDOT, inum, d_entry->inum);
+          }
+
+          if (!done) {
+            pd = 1;
+            if (inum != 1) { // not in root directory
+              // if not found current directory and
+              // parent directory not properly numbered, error
+              if (!cd && (d_entry->inum != inum))
+                done = 1;
+            } else { // in root directory
+              if (d_entry->inum != inum) // rd not properly numbered, error
+                done = 1;
+            }
+          }
+        }
+
+        if (!done && cd && pd) { // found both current and root directories
+          rc = 0;
+          done = 1;
+        }
+      }
+
+      if (sc->refs != NULL)
+        scan_dirents(block, &kinds, inum, ninodes, b_addr,
+                     (block - dirents)*sizeof(struct dirent), sc);
+    }
+  }
+
+  // the indirect data blocks only name inodes, which a quick scan skips
+  if ((i_block == NULL) || (sc->refs == NULL))
+    return rc;
+
+  // loop through all indirect blocks
+  for (int i = 0; i < NINDIRECT(bsize); i++) {
+    b_addr = i_block[i];
+    if (b_addr == 0) // address not in use
+      continue;
+    dirents = read_block(img, b_addr, &buf);
+    sc->dirent_blocks++;
+    for (block = dirents; block < dirents + DPB(bsize); block += DGROUP) {
+      classify_dirents(block, &kinds);
+      scan_dirents(block, &kinds, inum, ninodes, b_addr,
+                   (block - dirents)*sizeof(struct dirent), sc);
+    }
+  }
+
+  return rc;
+}
+
+// check #5, one inode at a time
+// only used to find the inode at fault once reconcile_bitmap has found a
+// block in use that is marked free; *bad is set to that block
+int check_valid_bitmap(char *bm,
+                       struct dinode *node,
+                       uint *i_block,
+                       uint *bad,
+                       uint bsize) {
+  uint b_addr;
+
+  // loop through all direct blocks in each inode
+  for (int i = 0; i < NDIRECT; i++) {
+    b_addr = node->addrs[i];
+    if (b_addr == 0) // address not in use
+      continue;
+    // if inode in use but marked free in bitmap, error
+    if (!CHECKBIT(bm, b_addr)) {
+      *bad = b_addr;
+      return -1;
+    }
+  }
+
+  if (i_block == NULL)
+    return 0;
+
+  // loop through all indirect blocks
+  for (int i = 0; i < NINDIRECT(bsize); i++) {
+    b_addr = i_block[i];
+    if (b_addr == 0) // address not in use
+      continue;
+    // if inode in use but marked free in bitmap, error
+    if (!CHECKBIT(bm, b_addr)) {
+      *bad = b_addr;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// helper for checks #7 and #8
+// claim block for inum, remembering the first block claimed twice
+void claim_block(int *owner, struct dup_addr *dup, uint block, int inum) {
+  int prev = __atomic_exchange_n(owner, inum + 1, __ATOMIC_RELAXED);
+  if ((prev != 0) && !dup->found) { // found repeat address, error
+    dup->found = 1;
+    dup->block = block;
+    dup->inum[0] = prev - 1;
+    dup->inum[1] = inum;
+  }
+}
+
+// helper for checks #7 and #8
+// the line printed below the error
+void describe_dup(char *detail, int len, struct dup_addr *dup) {
+  snprintf(detail, len, "  block %u used by inode %d and inode %d.\n",
+           dup->block, dup->inum[0], dup->inum[1]);
+}
+
+// helper for checks #6-8
+// record the blocks of an in-use inode; verdicts are given after the pass
+PER_BSIZE
+void find_used_datablocks(struct dinode *dip,
+                          uint *i_block,
+                          int inum,
+                          struct scan *sc,
+                          uint bsize) {
+  uint b_addr;
+
+  // loop through all address blocks (direct and indirect) in each inode
+  for (int i = 0; i <= NDIRECT; i++) {
+    b_addr = dip->addrs[i];
+    if (b_addr == 0) // address not in use
+      continue;
+
+    SETBIT(sc->used, b_addr); // mark block as in use
+    if (sc->facts != NULL)
+      log_fact(sc->facts, (i < NDIRECT) ? F_DIRECT : F_IBLOCK, inum, b_addr);
+
+    if (i < NDIRECT) {
+      SETBIT(sc->used_addrs, b_addr);
+      if (sc->owners != NULL)
+        claim_block(&sc->owners[b_addr].direct, &sc->direct_dup, b_addr,
+                    inum);
+    }
+  }
+
+  if (i_block == NULL)
+    return;
+
+  // loop through all indirect blocks
+  for (int i = 0; i < NINDIRECT(bsize); i++) {
+    b_addr = i_block[i];
+    if (b_addr == 0) // address not in use
+      continue;
+
+    SETBIT(sc->used, b_addr); // mark block as in use
+    SETBIT(sc->used_addrs, b_addr);
+    if (sc->facts != NULL)
+      log_fact(sc->facts, F_INDIRECT, inum, b_addr);
+
+    if (sc->owners != NULL)
+      claim_block(&sc->owners[b_addr].indirect, &sc->indirect_dup, b_addr,
+                  inum);
+  }
+}
+
+// checks #1-4 on a single in-use inode, recording along the way everything
+// checks #5-12, E1 and E2 need; returns the failed check or OK
+PER_BSIZE
+int scan_inode(struct image *img,
+               struct superblock *sb,
+               struct dinode *dip,
+               int inum,
+               struct scan *sc,
+               uint bsize) {
+  union block buf;
+  uint *i_block;
+  int dir_rc = 0;
+
+  sc->inodes++;
+
+  // check #1
+  // each inode is either unallocated or a valid type
+  if (check_valid_inodes(dip->type) < 0)
+    return BAD_INODE;
+
+  // check #2A
+  // each address used by direct block in inode is valid
+  if (check_valid_direct(dip, sb->size) < 0)
+    return BAD_DIRECT;
+
+  // check #2B
+  // each address used by indirect block in inode is valid
+  if (check_valid_indirect(img, dip, sb->size, &buf, &i_block, bsize) < 0)
+    return BAD_INDIRECT;
+  if (i_block != NULL)
+    sc->indirect_blocks++;
+
+  inode_infos[inum].type = dip->type;
+  inode_infos[inum].nlink = dip->nlink;
+
+  if (dip->type == T_DIR)
+    dir_rc = check_valid_dir(img, dip, i_block, inum, sb->ninodes, sc, bsize);
+
+  // check #3
+  // root directory exists, inode number is 1, parent of root is self
+  if ((inum == 1) && ((dip->type != T_DIR) || (dir_rc < 0)))
+    return NO_ROOT;
+
+  // check #4
+  // each directory contsin . and .., . points to directory itself
+  if (dir_rc < 0)
+    return BAD_DIR;
+
+  find_used_datablocks(dip, i_block, inum, sc, bsize);
+  return OK;
+}
+
+// asynchronous reads
+// when the image is streamed, a scan thread can keep up to img->io_depth
+// reads in flight of the indirect and directory blocks of the inodes in its
+// window, in inode order, and before checking an inode waits only for the
+// reads of that inode and those before it. Reads go through an io_uring of
+// the thread's own where the kernel has one, and otherwise through a pool of
+// threads doing pread. Each block read is put in the cache, where the checks
+// then find it
+
+// one read in flight
+struct fetch_slot {
+  uint block;
+  int done;              // data holds the block
+  char *data;
+};
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// most threads in the pool of one scan thread
+#define FETCH_THREADS 64
+
+struct fetch {
+  struct image *img;
+  uint depth;            // reads in flight at most
+  struct fetch_slot *slots; // read seq is in slots[seq % depth]
+  uint64_t lo;           // reads before lo are in the cache
+  uint64_t next;         // reads before next were started
+  uint64_t horizon;      // reads from here on wait for the checks
+  uint *want;            // blocks to read, in order, from wpos on
+  uint nwant, wpos;
+  int ring_fd;           // the io_uring, or -1 for the pool
+#ifdef HAVE_IO_URING
+  uint *sq_tail, *sq_mask, *sq_array;
+  uint *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_len, cq_len, sqes_len;
+#endif
+  pthread_t *threads;
+  uint nthreads;
+  uint64_t taken;        // reads before taken were picked up by the pool
+  int stop;
+  pthread_mutex_t lock;
+  pthread_cond_t work;   // a read was started
+  pthread_cond_t done;   // a read finished
+};
+
+#ifdef HAVE_IO_URING
+// helper for asynchronous reads
+// map the rings of an io_uring for f; returns -1 if there is none to be had
+int uring_open(struct fetch *f) {
+  struct io_uring_params p = { 0 };
+  char *sq, *cq;
+  int fd;
+
+  if ((fd = syscall(__NR_io_uring_setup, f->depth, &p)) < 0)
+    return -1;
+  f->sq_len = p.sq_off.array + p.sq_entries*sizeof(uint);
+  f->cq_len = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    f->sq_len = f->cq_len = (f->sq_len > f->cq_len) ? f->sq_len : f->cq_len;
+  f->sqes_len = p.sq_entries*sizeof(struct io_uring_sqe);
+  f->sq_ring = mmap(NULL, f->sq_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  f->cq_ring = (p.features & IORING_FEAT_SINGLE_MMAP) ? f->sq_ring :
+               mmap(NULL, f->cq_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  f->sqes = mmap(NULL, f->sqes_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if ((f->sq_ring == MAP_FAILED) || (f->cq_ring == MAP_FAILED) ||
+      (f->sqes == MAP_FAILED))
+    die();
+
+  sq = f->sq_ring;
+  cq = f->cq_ring;
+  f->sq_tail = (uint *) (sq + p.sq_off.tail);
+  f->sq_mask = (uint *) (sq + p.sq_off.ring_mask);
+  f->sq_array = (uint *) (sq + p.sq_off.array);
+  f->cq_head = (uint *) (cq + p.cq_off.head);
+  f->cq_tail = (uint *) (cq + p.cq_off.tail);
+  f->cq_mask = (uint *) (cq + p.cq_off.ring_mask);
+  f->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  f->ring_fd = fd;
+  return 0;
+}
+
+// helper for asynchronous reads
+void uring_close(struct fetch *f) {
+  munmap(f->sqes, f->sqes_len);
+  if (f->cq_ring != f->sq_ring)
+    munmap(f->cq_ring, f->cq_len);
+  munmap(f->sq_ring, f->sq_len);
+  if (close(f->ring_fd) < 0)
+    die();
+}
+
+// helper for asynchronous reads
+// queue the read seq on the ring; the kernel sees it at the next uring_enter
+void uring_prep(struct fetch *f, uint64_t seq) {
+  struct fetch_slot *slot = &f->slots[seq % f->depth];
+  uint tail = *f->sq_tail, k = tail & *f->sq_mask;
+  struct io_uring_sqe *sqe = &f->sqes[k];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = f->img->fd;
+  sqe->off = (uint64_t) slot->block*f->img->bsize;
+  sqe->addr = (uint64_t) (uintptr_t) slot->data;
+  sqe->len = f->img->bsize;
+  sqe->user_data = seq;
+  f->sq_array[k] = k;
+  __atomic_store_n(f->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// helper for asynchronous reads
+// hand n queued reads to the kernel, and wait for one to finish if wait
+void uring_enter(struct fetch *f, uint n, int wait) {
+  while (syscall(__NR_io_uring_enter, f->ring_fd, n, wait ? 1 : 0,
+                 wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0)
+    if (errno != EINTR)
+      die();
+}
+
+// helper for asynchronous reads
+// mark the reads the kernel has finished as done; one it could not do in
+// full, past the end of the image or on a kernel without IORING_OP_READ, is
+// done again with pread
+void uring_reap(struct fetch *f) {
+  uint head = *f->cq_head;
+  struct io_uring_cqe *cqe;
+  struct fetch_slot *slot;
+
+  while (head != __atomic_load_n(f->cq_tail, __ATOMIC_ACQUIRE)) {
+    cqe = &f->cqes[head & *f->cq_mask];
+    slot = &f->slots[cqe->user_data % f->depth];
+    if (cqe->res == (int) f->img->bsize)
+      __atomic_fetch_add(&f->img->bytes_read, cqe->res, __ATOMIC_RELAXED);
+    else
+      pread_blocks(f->img, slot->block, 1, slot->data);
+    slot->done = 1;
+    head++;
+  }
+  __atomic_store_n(f->cq_head, head, __ATOMIC_RELEASE);
+}
+#endif
+
+// a thread of the pool, reading the blocks f starts in order
+void *fetch_thread(void *arg) {
+  struct fetch *f = arg;
+  struct fetch_slot *slot;
+
+  pthread_mutex_lock(&f->lock);
+  for (;;) {
+    while (!f->stop && (f->taken == f->next))
+      pthread_cond_wait(&f->work, &f->lock);
+    if (f->taken == f->next) // stopped, with nothing left
+      break;
+    slot = &f->slots[f->taken++ % f->depth];
+    pthread_mutex_unlock(&f->lock);
+    pread_blocks(f->img, slot->block, 1, slot->data);
+    pthread_mutex_lock(&f->lock);
+    slot->done = 1;
+    pthread_cond_broadcast(&f->done);
+  }
+  pthread_mutex_unlock(&f->lock);
+  return NULL;
+}
+
+// set up f for reads of img with the space it needs from the scratch arena:
+// an io_uring if there is one, or else the pool
+void fetch_open(struct fetch *f, struct image *img, uint niwindow) {
+  memset(f, 0, sizeof(*f));
+  f->img = img;
+  f->depth = img->io_depth;
+  f->slots = arena_alloc(f->depth*sizeof(struct fetch_slot));
+  char *data = arena_alloc((size_t) f->depth*img->bsize);
+  for (uint i = 0; i < f->depth; i++)
+    f->slots[i].data = data + (size_t) i*img->bsize;
+  f->want = arena_alloc(niwindow*(NDIRECT + 1)*sizeof(uint));
+  f->ring_fd = -1;
+#ifdef HAVE_IO_URING
+  if (uring_open(f) == 0)
+    return;
+#endif
+  pthread_mutex_init(&f->lock, NULL);
+  pthread_cond_init(&f->work, NULL);
+  pthread_cond_init(&f->done, NULL);
+  f->nthreads = (f->depth < FETCH_THREADS) ? f->depth : FETCH_THREADS;
+  f->threads = arena_alloc(FETCH_THREADS*sizeof(pthread_t));
+  for (uint i = 0; i < f->nthreads; i++)
+    if (pthread_create(&f->threads[i], NULL, fetch_thread, f) != 0)
+      die();
+}
+
+// start the reads of the blocks wanted while there is room, and no further
+// than depth reads ahead of what the checks wait for
+void fetch_start(struct fetch *f) {
+  struct fetch_slot *slot;
+  uint n = 0;
+
+  if (f->ring_fd < 0)
+    pthread_mutex_lock(&f->lock);
+  while ((f->wpos < f->nwant) && (f->next - f->lo < f->depth) &&
+         (f->next < f->horizon)) {
+    slot = &f->slots[f->next % f->depth];
+    slot->block = f->want[f->wpos++];
+    slot->done = 0;
+#ifdef HAVE_IO_URING
+    if (f->ring_fd >= 0)
+      uring_prep(f, f->next);
+#endif
+    f->next++;
+    n++;
+  }
+  if (f->ring_fd < 0) {
+    if (n > 0)
+      pthread_cond_broadcast(&f->work);
+    pthread_mutex_unlock(&f->lock);
+  }
+#ifdef HAVE_IO_URING
+  if ((f->ring_fd >= 0) && (n > 0))
+    uring_enter(f, n, 0);
+#endif
+}
+
+// wait until the reads before seq are in the cache, or every read started
+// if fewer; finished reads are put in the cache in the order they started
+void fetch_until(struct fetch *f, uint64_t seq) {
+  struct fetch_slot *slot;
+
+  if (seq + f->depth > f->horizon)
+    f->horizon = seq + f->depth;
+  for (;;) {
+    fetch_start(f);
+    if (f->ring_fd < 0)
+      pthread_mutex_lock(&f->lock);
+#ifdef HAVE_IO_URING
+    else
+      uring_reap(f);
+#endif
+    for (; (f->lo < f->next) && f->slots[f->lo % f->depth].done; f->lo++)
+      cache_insert(f->img, f->slots[f->lo % f->depth].block,
+                   f->slots[f->lo % f->depth].data);
+    if ((f->lo >= seq) || ((f->lo == f->next) && (f->wpos == f->nwant)))
+      break;
+    slot = &f->slots[f->lo % f->depth];
+    if (f->ring_fd < 0) {
+      while ((f->lo < f->next) && !slot->done)
+        pthread_cond_wait(&f->done, &f->lock);
+      pthread_mutex_unlock(&f->lock);
+    }
+#ifdef HAVE_IO_URING
+    else if (f->lo < f->next)
+      uring_enter(f, 0, 1);
+#endif
+  }
+  if (f->ring_fd < 0)
+    pthread_mutex_unlock(&f->lock);
+  fetch_start(f); // the slots just freed
+}
+
+// read ahead for the n inodes at dip, most recently read: what is left of
+// the last window is dropped, and ends[k] is set to the reads inode k waits
+// for. Only addresses a scan would read are taken
+void fetch_window(struct fetch *f,
+                  struct dinode *dip,
+                  uint n,
+                  uint64_t *ends,
+                  uint size) {
+  uint a;
+
+  f->nwant = f->wpos = 0;
+  for (uint k = 0; k < n; k++, dip++) {
+    if (dip->type != 0) {
+      if (((a = dip->addrs[NDIRECT]) != 0) && (a < size) &&
+          !in_hole(f->img, a, 1))
+        f->want[f->nwant++] = a;
+      for (uint j = 0; (dip->type == T_DIR) && (j < NDIRECT); j++)
+        if (((a = dip->addrs[j]) != 0) && (a < size) &&
+            !in_hole(f->img, a, 1))
+          f->want[f->nwant++] = a;
+    }
+    ends[k] = f->next + f->nwant;
+  }
+  fetch_start(f);
+}
+
+// finish every read started and let go of the ring or the pool
+void fetch_close(struct fetch *f) {
+  f->nwant = f->wpos = 0;
+  fetch_until(f, f->next);
+  if (f->ring_fd >= 0) {
+#ifdef HAVE_IO_URING
+    uring_close(f);
+#endif
+    return;
+  }
+  pthread_mutex_lock(&f->lock);
+  f->stop = 1;
+  pthread_cond_broadcast(&f->work);
+  pthread_mutex_unlock(&f->lock);
+  for (uint i = 0; i < f->nthreads; i++)
+    pthread_join(f->threads[i], NULL);
+  pthread_mutex_destroy(&f->lock);
+  pthread_cond_destroy(&f->work);
+  pthread_cond_destroy(&f->done);
+}
+
+// a thread scanning the inode table; work is handed out by inode block
+// (IBLOCK), and a thread that runs out steals half of another's remainder
+struct worker {
+  pthread_t tid;
+  pthread_mutex_t lock;
+  uint next, end;        // inode blocks left to this thread
+  int id;
+  int err;               // first failed check, at inode bad_inum
+  uint bad_inum;
+  struct scan sc;
+  struct scan_job *job;
+  char *win;             // inode blocks read ahead when streaming
+  uint win_lo, win_n;
+  char *win_buf;
+  struct fetch fetch;    // the blocks their inodes name, with img->io_depth
+  uint64_t *win_ends;    // the reads each inode of the window waits for
+};
+
+// inode blocks read at once when streaming
+#define IWINDOW 64
+
+// an inode table scan shared by all threads
+struct scan_job {
+  struct image *img;
+  struct superblock *sb;
+  uint niblocks;
+  struct worker *workers;
+  int nworkers;
+  uint first_bad;        // lowest inode block with a failed check
+  ushort *block_worker;  // thread that scanned each inode block
+  void *(*scan)(void *); // scan_worker_512 or scan_worker_1024
+  struct inode_info *infos; // the inode_infos of the thread that started it
+  int recover;           // whether it can bail, rather than exit, on die
+  int died;              // some thread gave up
+};
+
+// take the next inode block for w, stealing from another thread if needed
+int next_iblock(struct scan_job *job, struct worker *w, uint *b) {
+  pthread_mutex_lock(&w->lock);
+  if (w->next < w->end) {
+    *b = w->next++;
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+  }
+  pthread_mutex_unlock(&w->lock);
+
+  for (int k = 1; k < job->nworkers; k++) {
+    struct worker *v = &job->workers[(w->id + k) % job->nworkers];
+    uint lo, hi;
+
+    pthread_mutex_lock(&v->lock);
+    if (v->next >= v->end) {
+      pthread_mutex_unlock(&v->lock);
+      continue;
+    }
+    hi = v->end;
+    lo = v->end - (v->end - v->next + 1) / 2; // back half of what is left
+    v->end = lo;
+    pthread_mutex_unlock(&v->lock);
+
+    pthread_mutex_lock(&w->lock);
+    w->next = lo + 1;
+    w->end = hi;
+    pthread_mutex_unlock(&w->lock);
+    *b = lo;
+    return 0;
+  }
+  return -1;
+}
+
+// the inodes in inode block b for w, read ahead IWINDOW blocks at a time
+PER_BSIZE
+struct dinode *worker_iblock(struct worker *w, uint b, uint bsize) {
+  struct scan_job *job = w->job;
+
+  if ((w->win == NULL) || (b < w->win_lo) || (b >= w->win_lo + w->win_n)) {
+    w->win_lo = b;
+    w->win_n = (job->niblocks - b < IWINDOW) ? job->niblocks - b : IWINDOW;
+    w->win = read_blocks(job->img, job->sb->inodestart + b, w->win_n,
+                         w->win_buf);
+    if (w->fetch.depth > 0) {
+      uint n = w->win_n*IPB(bsize);
+      if (n > job->sb->ninodes - b*IPB(bsize))
+        n = job->sb->ninodes - b*IPB(bsize);
+      fetch_window(&w->fetch, (struct dinode *) w->win, n, w->win_ends,
+                   job->sb->size);
+    }
+  }
+  return (struct dinode *) (w->win + (b - w->win_lo)*bsize);
+}
+
+// checks #1-4 on every in-use inode handed to one thread, on an image of
+// bsize-byte blocks
+PER_BSIZE
+void scan_iblocks(struct worker *w, uint bsize) {
+  struct scan_job *job = w->job;
+  struct superblock *sb = job->sb;
+  struct dinode *dip = NULL;
+  uint b, i, last;
+  int err;
+
+  while (next_iblock(job, w, &b) == 0) {
+    // a lower inode block already failed, so this one cannot be reported
+    if (b > __atomic_load_n(&job->first_bad, __ATOMIC_RELAXED))
+      continue;
+
+    job->block_worker[b] = w->id;
+    if (in_hole(job->img, sb->inodestart + b, 1)) // no inode in use
+      continue;
+    last = (b + 1) * IPB(bsize) < sb->ninodes ? (b + 1) * IPB(bsize) :
+                                                sb->ninodes;
+    dip = worker_iblock(w, b, bsize);
+    for (i = b * IPB(bsize); i < last; i++, dip++) {
+      if (dip->type == 0) // unallocated inode, skip
+        continue;
+
+      if (w->fetch.depth > 0)
+        fetch_until(&w->fetch, w->win_ends[i - w->win_lo*IPB(bsize)]);
+      if ((err = scan_inode(job->img, sb, dip, i, &w->sc, bsize)) == OK)
+        continue;
+
+      if ((w->err == OK) || (i < w->bad_inum)) {
+        w->err = err;
+        w->bad_inum = i;
+      }
+      uint seen = __atomic_load_n(&job->first_bad, __ATOMIC_RELAXED);
+      while ((b < seen) &&
+             !__atomic_compare_exchange_n(&job->first_bad, &seen, b, 0,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+      break;
+    }
+  }
+}
+
+// scan_iblocks compiled for each block size, so the scan of either never
+// looks up the layout; scan_inodes picks one from the superblock
+void *scan_worker_512(void *arg) {
+  scan_iblocks(arg, 512);
+  return NULL;
+}
+
+void *scan_worker_1024(void *arg) {
+  scan_iblocks(arg, 1024);
+  return NULL;
+}
+
+// a thread of scan_inodes, which fills in the inode_infos of the thread that
+// started it; one that gives up returns, and leaves scan_inodes to give up
+void *scan_thread(void *arg) {
+  struct worker *w = arg;
+  jmp_buf *outer = bail, here;
+
+  inode_infos = w->job->infos;
+  if (w->job->recover) {
+    if (setjmp(here) != 0) {
+      __atomic_store_n(&w->job->died, 1, __ATOMIC_RELAXED);
+      bail = outer;
+      return NULL;
+    }
+    bail = &here;
+  }
+  w->job->scan(w);
+  bail = outer;
+  return NULL;
+}
+
+// helper for checks #7 and #8 with several threads
+// threads only learn that some block was claimed twice, so the first repeat
+// in inode order is found again, claiming the blocks one inode at a time
+void find_first_dup(struct image *img, struct superblock *sb, struct scan *sc) {
+  union block ibuf, buf;
+  struct dinode *dip = NULL;
+  uint *i_block;
+
+  memset(sc->owners, 0, sb->size*sizeof(struct block_owner));
+  memset(&sc->direct_dup, 0, sizeof(struct dup_addr));
+  memset(&sc->indirect_dup, 0, sizeof(struct dup_addr));
+  for (uint i = 0; i < sb->ninodes; i++, dip++) {
+    if (i % IPB(sb->bsize) == 0)
+      dip = read_blocks(img, IBLOCK(i, sb), 1, &ibuf);
+    if (dip->type == 0) // inode not in use
+      continue;
+
+    i_block = NULL;
+    if (dip->addrs[NDIRECT] != 0)
+      i_block = read_block(img, dip->addrs[NDIRECT], &buf);
+    find_used_datablocks(dip, i_block, i, sc, sb->bsize);
+  }
+}
+
+// checks #5 and #6 for the whole image at once: the blocks in use are
+// reconciled with the on-disk bitmap a word at a time
+void reconcile_bitmap(struct superblock *sb, struct scan *sc, uint db1) {
+  uint64_t *bm = (uint64_t *) sc->bm;
+  struct bit_counts c;
+
+  // check #5, blocks named by an address but marked free
+  andnot_bits(sc->used_addrs, bm, 0, sb->size, &c);
+  sc->bits.missing = c.diff;
+
+  andnot_bits(sc->used, bm, 0, sb->size, &c);
+  sc->bits.used = c.set;
+
+  // check #6, data blocks marked in use but in use nowhere
+  andnot_bits(bm, sc->used, db1, sb->dataend, &c);
+  sc->bits.leaked = c.diff;
+  sc->bits.first_leaked = c.first;
+  sc->bits.free = (db1 < sb->dataend) ? sb->dataend - db1 - c.set : 0;
+}
+
+// read-ahead
+// an inode names its indirect and directory blocks anywhere in the image, so
+// on a cold page cache the scan reads them one seek at a time. With
+// --readahead the inode table is read once beforehand, the blocks it names
+// are marked in a bitmap, and the kernel is asked for them in ascending
+// order, each run of nearby blocks at once
+
+// blocks of a gap no larger than this are read along with the runs around it
+#define RA_GAP 16
+
+// ask the kernel to read blocks [b, b + n), only a hint
+void readahead_run(struct image *img, uint b, uint n) {
+  size_t off = (size_t) b*img->bsize, len = (size_t) n*img->bsize;
+  size_t skew;
+
+  if (img->mem != NULL) {
+    skew = off % sysconf(_SC_PAGESIZE); // madvise starts on a page
+    madvise(img->mem + off - skew, len + skew, MADV_WILLNEED);
+  } else {
+    posix_fadvise(img->fd, off, len, POSIX_FADV_WILLNEED);
+  }
+}
+
+// read ahead every block set in bits below size, in ascending order
+void readahead_bits(struct image *img, uint64_t *bits, uint size) {
+  uint64_t w;
+  uint b, lo = 0, hi = 0; // the run [lo, hi), empty while hi is 0
+
+  for (uint k = 0; k < BITWORDS(size); k++) {
+    for (w = bits[k]; w != 0; w &= w - 1) {
+      b = k*64 + __builtin_ctzll(w);
+      if ((hi != 0) && (b <= hi + RA_GAP)) {
+        hi = b + 1;
+        continue;
+      }
+      if (hi != 0)
+        readahead_run(img, lo, hi - lo);
+      lo = b;
+      hi = b + 1;
+    }
+  }
+  if (hi != 0)
+    readahead_run(img, lo, hi - lo);
+}
+
+// read ahead the indirect blocks and directory blocks the inode table names:
+// the indirect blocks and direct directory blocks first, then the directory
+// blocks named by the indirect blocks of directories, which are read in
+// ascending order to find them
+void plan_readahead(struct image *img, struct superblock *sb) {
+  uint niblocks = (sb->ninodes + IPB(sb->bsize) - 1) / IPB(sb->bsize);
+  size_t mark = arena_mark();
+  uint64_t *want = arena_alloc(BITWORDS(sb->size)*sizeof(uint64_t));
+  uint64_t *dir_ind = arena_alloc(BITWORDS(sb->size)*sizeof(uint64_t));
+  char *win_buf = (img->mem == NULL) ? arena_alloc(IWINDOW*sb->bsize) : NULL;
+  struct dinode *dip;
+  union block buf;
+  uint64_t w;
+  uint *addr;
+  uint b, n, i, k, a;
+
+  for (b = 0; b < niblocks; b += n) {
+    n = (niblocks - b < IWINDOW) ? niblocks - b : IWINDOW;
+    dip = read_blocks(img, sb->inodestart + b, n, win_buf);
+    for (i = b*IPB(sb->bsize);
+         (i < (b + n)*IPB(sb->bsize)) && (i < sb->ninodes); i++, dip++) {
+      if (dip->type == 0)
+        continue;
+      if (((a = dip->addrs[NDIRECT]) != 0) && (a < sb->size)) {
+        SETBIT(want, a);
+        if (dip->type == T_DIR)
+          SETBIT(dir_ind, a);
+      }
+      for (k = 0; (dip->type == T_DIR) && (k < NDIRECT); k++)
+        if (((a = dip->addrs[k]) != 0) && (a < sb->size))
+          SETBIT(want, a);
+    }
+  }
+  readahead_bits(img, want, sb->size);
+
+  memset(want, 0, BITWORDS(sb->size)*sizeof(uint64_t));
+  for (k = 0; k < BITWORDS(sb->size); k++) {
+    for (w = dir_ind[k]; w != 0; w &= w - 1) {
+      addr = read_block(img, k*64 + __builtin_ctzll(w), &buf);
+      for (i = 0; i < NINDIRECT(sb->bsize); i++)
+        if ((addr[i] != 0) && (addr[i] < sb->size))
+          SETBIT(want, addr[i]);
+    }
+  }
+  readahead_bits(img, want, sb->size);
+  arena_release(mark);
+}
+
+// directory graph
+// the entries each scan found are put together into one graph once the whole
+// inode table is scanned. The entries of a directory are all found by one
+// scan, in order, so a counting sort by directory keeps them in order: rows
+// are counted from every scan, placed, then filled scan by scan
+
+// the rows, taken from the arena before anything that is released
+void graph_init(struct dir_graph *g, uint ninodes) {
+  g->row = arena_alloc(((size_t) ninodes + 1)*sizeof(uint));
+}
+
+void graph_count(struct dir_graph *g, struct scan *t) {
+  for (uint k = 0; k < t->nfound; k++)
+    g->row[t->found[k].parent + 1]++;
+}
+
+void graph_place(struct dir_graph *g, uint ninodes) {
+  for (uint i = 0; i < ninodes; i++)
+    g->row[i + 1] += g->row[i];
+  g->nedges = g->row[ninodes];
+  g->edge = malloc((g->nedges ? g->nedges : 1)*sizeof(struct dir_edge));
+  if (g->edge == NULL)
+    die();
+}
+
+// each row's start moves on as it is filled, ending where the next starts
+void graph_fill(struct dir_graph *g, struct scan *t) {
+  for (uint k = 0; k < t->nfound; k++)
+    g->edge[g->row[t->found[k].parent]++] = t->found[k].e;
+  free(t->found);
+  t->found = NULL;
+  t->nfound = t->found_cap = 0;
+}
+
+void graph_done(struct dir_graph *g, uint ninodes) {
+  memmove(g->row + 1, g->row, (size_t) ninodes*sizeof(uint));
+  g->row[0] = 0;
+}
+
+// only paths need the first entry naming each inode, and only a failed
+// check asks for those; checks failing on several threads at once build
+// them once between them
+pthread_mutex_t namers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint *graph_namers(struct dir_graph *g, uint ninodes) {
+  uint *namer;
+
+  pthread_mutex_lock(&namers_lock);
+  if ((namer = g->namer) != NULL) {
+    pthread_mutex_unlock(&namers_lock);
+    return namer;
+  }
+  if ((namer = malloc((ninodes ? ninodes : 1)*sizeof(uint))) == NULL) {
+    pthread_mutex_unlock(&namers_lock);
+    die();
+  }
+  for (uint i = 0; i < ninodes; i++)
+    namer[i] = NONE;
+  for (uint e = 0; e < g->nedges; e++) {
+    uint child = g->edge[e].child;
+    if (!g->edge[e].dotdot && (child < ninodes) && (namer[child] == NONE))
+      namer[child] = e;
+  }
+  __atomic_store_n(&g->namer, namer, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&namers_lock);
+  return namer;
+}
+
+// the directory holding edge e
+uint graph_parent(struct dir_graph *g, uint ninodes, uint e) {
+  uint lo = 0, hi = ninodes - 1, mid;
+
+  while (lo < hi) { // the last row starting at or before e
+    mid = lo + (hi - lo + 1) / 2;
+    if (g->row[mid] <= e)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+// where a directory entry is
+struct entry_at {
+  uint dir;   // the directory holding it
+  uint block;
+  uint off;   // byte offset of the entry in block
+};
+
+// where the nth named entry naming inum is, counting from 0 in the order of
+// the directories and then of the entries in their blocks; returns -1 if
+// there is none. Without a directory graph, as with --incremental or
+// --memory-limit, every directory is read to find it, which only a failed
+// check's message asks for
+int find_namer(struct image *img,
+               struct superblock *sb,
+               struct dir_graph *g,
+               uint inum,
+               uint nth,
+               struct entry_at *at) {
+  union block ibuf, abuf, buf;
+  struct dinode *dip = NULL;
+  struct dirent *dirents;
+  struct dirent_kinds kinds;
+  uint *i_block, *namer, b, e;
+
+  if (g->row != NULL) {
+    if ((namer = __atomic_load_n(&g->namer, __ATOMIC_ACQUIRE)) == NULL)
+      namer = graph_namers(g, sb->ninodes);
+    if ((e = namer[inum]) == NONE)
+      return -1;
+    for (; nth > 0; nth--)
+      for (e++; (e < g->nedges) && ((g->edge[e].child != inum) ||
+                                    g->edge[e].dotdot); e++)
+        ;
+    if (e >= g->nedges)
+      return -1;
+    *at = (struct entry_at) { graph_parent(g, sb->ninodes, e),
+                              g->edge[e].block, g->edge[e].off };
+    return 0;
+  }
+
+  for (uint i = 0; i < sb->ninodes; i++, dip++) {
+    if (i % IPB(sb->bsize) == 0)
+      dip = read_blocks(img, IBLOCK(i, sb), 1, &ibuf);
+    if (inode_infos[i].type != T_DIR)
+      continue;
+
+    i_block = NULL;
+    if (dip->addrs[NDIRECT] != 0)
+      i_block = read_block(img, dip->addrs[NDIRECT], &abuf);
+    for (uint k = 0; k < MAXFILE(sb->bsize); k++) {
+      if (k >= NDIRECT)
+        b = (i_block != NULL) ? i_block[k - NDIRECT] : 0;
+      else
+        b = dip->addrs[k];
+      if (b == 0) // address not in use
+        continue;
+
+      dirents = read_block(img, b, &buf);
+      for (uint n = 0; n < DPB(sb->bsize); n += DGROUP) {
+        classify_dirents(dirents + n, &kinds);
+        for (uint32_t m = kinds.used & ~(kinds.dot | kinds.dotdot); m != 0;
+             m &= m - 1) {
+          uint j = n + __builtin_ctz(m);
+          if ((dirents[j].inum != inum) || (nth-- > 0))
+            continue;
+          *at = (struct entry_at) { i, b, j*sizeof(struct dirent) };
+          return 0;
+        }
+      }
+    }
+  }
+  return -1;
+}
+
+// deeper paths never fit in a message
+#define PATH_DEPTH 128
+
+// room for a path in the line printed below an error
+#define DETAIL_PATH 160
+
+// the path from the root of the entry at, each directory on the way named by
+// the first entry naming it, written to path; returns -1, leaving path as it
+// was, when some directory on the way is named nowhere, the directories loop
+// or the path does not fit in len
+int entry_path(struct image *img,
+               struct superblock *sb,
+               struct dir_graph *g,
+               struct entry_at at,
+               char *path,
+               size_t len) {
+  struct entry_at chain[PATH_DEPTH];
+  union block buf;
+  struct dirent *d;
+  size_t off = 0;
+  uint n, k;
+
+  for (n = 0; n < PATH_DEPTH; n++) {
+    chain[n] = at;
+    if (at.dir == ROOTINO)
+      break;
+    for (k = 0; (k < n) && (chain[k].dir != at.dir); k++)
+      ;
+    if (k < n) // a loop
+      return -1;
+    if (find_namer(img, sb, g, at.dir, 0, &at) < 0)
+      return -1;
+  }
+  if (n == PATH_DEPTH)
+    return -1;
+
+  for (n++; n > 0; n--) {
+    at = chain[n - 1];
+    d = (struct dirent *) ((char *) read_block(img, at.block, &buf) + at.off);
+    size_t name_len = strnlen(d->name, DIRSIZ);
+    if (off + 1 + name_len >= len)
+      return -1;
+    path[off++] = '/';
+    memcpy(path + off, d->name, name_len);
+    off += name_len;
+  }
+  path[off] = '\0';
+  return 0;
+}
+
+// the path of inum from the root as entry_path gives it
+int inode_path(struct image *img,
+               struct superblock *sb,
+               struct dir_graph *g,
+               uint inum,
+               char *path,
+               size_t len) {
+  struct entry_at at;
+
+  if (inum >= sb->ninodes)
+    return -1;
+  if (inum == ROOTINO) {
+    snprintf(path, len, "/");
+    return 0;
+  }
+  if (find_namer(img, sb, g, inum, 0, &at) < 0)
+    return -1;
+  return entry_path(img, sb, g, at, path, len);
+}
+
+// " (/path)" of inum for a message, or "" when it has none
+char *path_note(struct image *img,
+                struct superblock *sb,
+                struct dir_graph *g,
+                uint inum,
+                char *note,
+                size_t len) {
+  char path[DETAIL_PATH];
+
+  note[0] = '\0';
+  if (inode_path(img, sb, g, inum, path, sizeof(path)) == 0)
+    snprintf(note, len, " (%s)", path);
+  return note;
+}
+
+// the only pass over the inode table, split across nthreads threads: checks
+// #1-4 are decided per inode and everything the remaining checks need is
+// recorded on the way, then merged into sc in the order of a single thread;
+// check #5 is decided for all inodes at once from the merged blocks in use
+int scan_inodes(struct image *img,
+                struct superblock *sb,
+                int nthreads,
+                struct scan *sc,
+                uint db1) {
+  uint niblocks = (sb->ninodes + IPB(sb->bsize) - 1) / IPB(sb->bsize);
+  // check #6 looks at blocks up to dataend, addresses go up to size
+  uint nused = (sb->size > sb->dataend) ? sb->size : sb->dataend;
+  struct scan_job job = { 0 };
+  struct worker *w;
+  int i, err;
+
+  job.img = img;
+  job.sb = sb;
+  job.niblocks = niblocks;
+  job.nworkers = nthreads;
+  job.first_bad = niblocks; // no failure yet
+  job.scan = (sb->bsize == MAXBSIZE) ? scan_worker_1024 : scan_worker_512;
+  job.infos = inode_infos;
+  job.recover = (bail != NULL);
+
+  // the first thread's records are merged into and kept, the rest are
+  // scratch for this scan only; a quick or partitioned scan keeps neither
+  // refs nor owners
+  int keep = (sc->tier != TIER_QUICK) && !sc->partitioned;
+  struct scan first = { 0 };
+  first.tier = sc->tier;
+  first.partitioned = sc->partitioned;
+  first.used = arena_alloc(BITWORDS(nused)*sizeof(uint64_t));
+  first.used_addrs = arena_alloc(BITWORDS(nused)*sizeof(uint64_t));
+  if (keep) {
+    first.refs = arena_alloc(sb->ninodes*sizeof(int));
+    sc->owners = arena_alloc(sb->size*sizeof(struct block_owner));
+    graph_init(&first.graph, sb->ninodes);
+  }
+  size_t mark = arena_mark();
+  job.workers = arena_alloc(nthreads*sizeof(struct worker));
+  job.block_worker = arena_alloc(niblocks*sizeof(ushort));
+
+  for (i = 0; i < nthreads; i++) {
+    w = &job.workers[i];
+    pthread_mutex_init(&w->lock, NULL);
+    w->id = i;
+    w->job = &job;
+    w->next = (uint) ((unsigned long) niblocks * i / nthreads);
+    w->end = (uint) ((unsigned long) niblocks * (i + 1) / nthreads);
+    if (i == 0) {
+      w->sc = first;
+    } else {
+      w->sc.used = arena_alloc(BITWORDS(nused)*sizeof(uint64_t));
+      w->sc.used_addrs = arena_alloc(BITWORDS(nused)*sizeof(uint64_t));
+      if (keep)
+        w->sc.refs = arena_alloc(sb->ninodes*sizeof(int));
+    }
+    w->sc.tier = sc->tier;
+    w->sc.bm = sc->bm;
+    w->sc.owners = sc->owners;
+    if (img->mem == NULL)
+      w->win_buf = arena_alloc(IWINDOW*sb->bsize);
+    if ((img->mem == NULL) && (img->io_depth > 0)) {
+      fetch_open(&w->fetch, img, IWINDOW*IPB(sb->bsize));
+      w->win_ends = arena_alloc(IWINDOW*IPB(sb->bsize)*sizeof(uint64_t));
+    }
+  }
+
+  if (nthreads == 1) {
+    scan_thread(&job.workers[0]);
+  } else {
+    int started;
+    for (started = 0; started < nthreads; started++)
+      if (pthread_create(&job.workers[started].tid, NULL, scan_thread,
+                         &job.workers[started]) != 0) {
+        job.died = 1;
+        break;
+      }
+    for (i = 0; i < started; i++)
+      pthread_join(job.workers[i].tid, NULL);
+  }
+  for (i = 0; i < nthreads; i++)
+    if (job.workers[i].fetch.depth > 0)
+      fetch_close(&job.workers[i].fetch);
+  if (job.died) {
+    for (i = 0; i < nthreads; i++) {
+      pthread_mutex_destroy(&job.workers[i].lock);
+      free(job.workers[i].sc.dotdots);
+      free(job.workers[i].sc.found);
+    }
+    die();
+  }
+
+  // first failed check in inode order
+  err = OK;
+  uint bad_inum = 0;
+  for (i = 0; i < nthreads; i++) {
+    w = &job.workers[i];
+    if ((w->err != OK) && ((err == OK) || (w->bad_inum < bad_inum))) {
+      err = w->err;
+      bad_inum = w->bad_inum;
+    }
+  }
+
+  // merge every thread's records into the first one's
+  struct scan *m = &job.workers[0].sc;
+  uint *dd_base = arena_alloc(nthreads*sizeof(uint));
+  for (i = 1; i < nthreads; i++) {
+    struct scan *t = &job.workers[i].sc;
+    for (uint64_t k = 0; k < BITWORDS(nused); k++) {
+      m->used[k] |= t->used[k];
+      m->used_addrs[k] |= t->used_addrs[k];
+    }
+    m->inodes += t->inodes;
+    m->dirent_blocks += t->dirent_blocks;
+    m->indirect_blocks += t->indirect_blocks;
+
+    if (err != OK) // other records are of no use past a failed check
+      continue;
+
+    for (uint n = 0; keep && (n < sb->ninodes); n++)
+      m->refs[n] += t->refs[n];
+    if (t->direct_dup.found)
+      m->direct_dup.found = 1;
+    if (t->indirect_dup.found)
+      m->indirect_dup.found = 1;
+
+    dd_base[i] = m->ndotdots;
+    for (uint k = 0; k < t->ndotdots; k++)
+      add_dotdot(m, t->dotdots[k]);
+  }
+
+  m->checks_1_4_ok = (err == OK);
+
+  // the directory graph, from the entries every thread found; a repair needs
+  // it whatever check #5 finds below
+  if (keep && m->checks_1_4_ok) {
+    for (i = 0; i < nthreads; i++)
+      graph_count(&m->graph, &job.workers[i].sc);
+    graph_place(&m->graph, sb->ninodes);
+    for (i = 0; i < nthreads; i++)
+      graph_fill(&m->graph, &job.workers[i].sc);
+    graph_done(&m->graph, sb->ninodes);
+  } else {
+    m->graph.row = NULL;
+  }
+
+  // check #5
+  // for in-use inodes, each address in use is also marked in use in bitmap;
+  // should any block be marked free, the first inode using one may still
+  // come before an inode that failed checks #1-4
+  reconcile_bitmap(sb, m, db1);
+  if (m->bits.missing > 0) {
+    uint last = (err == OK) ? sb->ninodes : bad_inum;
+    union block ibuf, buf;
+    struct dinode *dip = NULL;
+    uint *i_block;
+
+    for (uint n = 0; n < last; n++, dip++) {
+      if (n % IPB(sb->bsize) == 0)
+        dip = read_blocks(img, IBLOCK(n, sb), 1, &ibuf);
+      if (dip->type == 0) // inode not in use
+        continue;
+
+      i_block = NULL;
+      if (dip->addrs[NDIRECT] != 0)
+        i_block = read_block(img, dip->addrs[NDIRECT], &buf);
+      if (check_valid_bitmap(m->bm, dip, i_block, &m->bad_block,
+                             sb->bsize) < 0) {
+        err = BITMAP_FREE;
+        m->bad_inum = n;
+        break;
+      }
+    }
+  }
+
+  // .. entries were numbered within the thread that found them
+  if ((err == OK) && (nthreads > 1)) {
+    for (uint n = 0; n < sb->ninodes; n++)
+      inode_infos[n].dd_start +=
+        dd_base[job.block_worker[n / IPB(sb->bsize)]];
+    if (m->direct_dup.found || m->indirect_dup.found)
+      find_first_dup(img, sb, m);
+  }
+
+  for (i = 0; i < nthreads; i++) {
+    pthread_mutex_destroy(&job.workers[i].lock);
+    free(job.workers[i].sc.found);
+    job.workers[i].sc.found = NULL;
+    if (i > 0)
+      free(job.workers[i].sc.dotdots);
+  }
+  *sc = *m;
+  arena_release(mark);
+  return err;
+}
+
+// extra check #1
+// every .. entry of a directory must name the directory that names it, or
+// the root itself for the root
+int check_parent_dir(struct image *img,
+                     struct superblock *sb,
+                     struct dir_graph *g,
+                     char *detail,
+                     size_t len) {
+  char note[DETAIL_PATH + 3];
+  uint parent;
+
+  for (int i = 1; i < sb->ninodes; i++) {
+    if ((i % 4096 == 0) && stopped())
+      return 0;
+    if (inode_infos[i].type != T_DIR)
+      continue;
+
+    parent = (i == ROOTINO) ? ROOTINO : inode_infos[i].parent;
+    if (inode_infos[i].dotdot == parent)
+      continue;
+
+    path_note(img, sb, g, i, note, sizeof(note));
+    if (inode_infos[i].dotdot == BAD_DOTDOT)
+      snprintf(detail, len, "  directory %d%s has conflicting .. entries.\n",
+               i, note);
+    else
+      snprintf(detail, len, "  directory %d%s has .. %u but is named in %u.\n",
+               i, note, inode_infos[i].dotdot, parent);
+    return -1;
+  }
+  return 0;
+}
+
+// checks #10-12
+// the inode at fault named by its path on the line printed below the error,
+// and for check #12 two of the entries naming it
+void describe_names(struct image *img,
+                    struct superblock *sb,
+                    struct scan *sc,
+                    int err,
+                    uint inum,
+                    int nrefs,
+                    char *detail,
+                    size_t len) {
+  struct dir_graph *g = &sc->graph;
+  char note[DETAIL_PATH + 3], first[DETAIL_PATH], second[DETAIL_PATH];
+  struct entry_at at;
+
+  path_note(img, sb, g, inum, note, sizeof(note));
+  if (err == REF_FREE) {
+    snprintf(detail, len, "  inode %u%s is free.\n", inum, note);
+    return;
+  }
+  if (err == BAD_REFCOUNT) {
+    snprintf(detail, len, "  file %u%s has %d links and %d names.\n", inum,
+             note, inode_infos[inum].nlink, nrefs);
+    return;
+  }
+
+  if ((inode_path(img, sb, g, inum, first, sizeof(first)) == 0) &&
+      (find_namer(img, sb, g, inum, 1, &at) == 0) &&
+      (entry_path(img, sb, g, at, second, sizeof(second)) == 0)) {
+    snprintf(detail, len, "  directory %u is named both %s and %s.\n", inum,
+             first, second);
+    return;
+  }
+  snprintf(detail, len, "  directory %u%s has %d names.\n", inum, note,
+           nrefs);
+}
+
+// helper for extra check #2
+// the .. entries of every inode a chain can reach, other than 0 and 1; a
+// chain ends at an inum past the inode table, which extra check #1 reports
+struct dotdot_graph {
+  uint nnodes;
+  uint *start; // index of first .. entry in scan.dotdots
+  uint *count; // number of .. entries
+  char *loaded;
+  int multi;   // some inode has more than one .. entry
+  struct report *rep; // with --all, every loop is recorded and walks go on
+};
+
+// helper for extra check #2
+// directories use the .. entries recorded by the single pass; any other
+// inode reached through a .. entry is read from the image once
+void load_dotdots(struct image *img,
+                  struct superblock *sb,
+                  struct scan *sc,
+                  struct dotdot_graph *g,
+                  uint inum) {
+  struct dinode node;
+  union block buf;
+  struct dirent *dirents, *block;
+  struct dirent_kinds kinds;
+  uint b_addr;
+  ushort parent;
+
+  g->loaded[inum] = 1;
+  if ((inum < sb->ninodes) && (inode_infos[inum].type == T_DIR)) {
+    g->start[inum] = inode_infos[inum].dd_start;
+    g->count[inum] = inode_infos[inum].dd_count;
+  } else {
+    g->start[inum] = sc->ndotdots;
+    read_inode(img, sb, inum, &node);
+    for (int i = 0; i < NDIRECT; i++) {
+      b_addr = node.addrs[i];
+      if ((b_addr == 0) || (b_addr >= sb->size))
+        continue;
+
+      dirents = read_block(img, b_addr, &buf);
+      sc->dirent_blocks++;
+      for (block = dirents; block < dirents + DPB(sb->bsize);
+           block += DGROUP) {
+        classify_dirents(block, &kinds);
+        for (uint32_t m = kinds.dotdot; m != 0; m &= m - 1) {
+          parent = block[__builtin_ctz(m)].inum;
+          if (parent < 2)
+            continue;
+          add_dotdot(sc, parent);
+          g->count[inum]++;
+        }
+      }
+    }
+  }
+  if (g->count[inum] > 1)
+    g->multi = 1;
+}
+
+// helper for extra check #2
+// names the inodes of a loop on the line printed below the error
+void describe_loop(char *detail, size_t len, uint *path, uint n) {
+  size_t off = snprintf(detail, len, "  loop through inodes %u", path[0]);
+  for (uint k = 1; k <= n; k++) {
+    if (off + 16 > len) { // no room for another inum and the " ...\n"
+      snprintf(detail + off, len - off, " ...\n");
+      return;
+    }
+    off += snprintf(detail + off, len - off, " -> %u", path[k % n]);
+  }
+  snprintf(detail + off, len - off, ".\n");
+}
+
+#define WHITE 0 // not walked yet
+#define GREY  1 // on the chain being walked
+#define BLACK 2 // chain known to end at the root
+
+// helper for extra check #2
+// with one .. entry per inode every chain is a path, walked until it reaches
+// the root or an inode an earlier chain already cleared; each inode is
+// walked once
+int walk_chains(struct dotdot_graph *g,
+                struct scan *sc,
+                int ninodes,
+                char *detail,
+                size_t len) {
+  char *colour;
+  uint *pos, *path;
+  uint n, v;
+  int i, rc;
+  rc = 0;
+
+  colour = arena_alloc(g->nnodes*sizeof(char));
+  pos = arena_alloc(g->nnodes*sizeof(uint));
+  path = arena_alloc(g->nnodes*sizeof(uint));
+
+  for (i = 0; (i < ninodes) && ((rc == 0) || g->rep); i++) {
+    if ((i % 4096 == 0) && stopped())
+      break;
+    if ((inode_infos[i].type != T_DIR) || (colour[i] != WHITE))
+      continue;
+
+    n = 0;
+    v = i;
+    for (;;) {
+      colour[v] = GREY;
+      pos[v] = n;
+      path[n++] = v;
+      if (g->count[v] == 0) // reached the root
+        break;
+
+      v = sc->dotdots[g->start[v]];
+      if (v >= g->nnodes) // past the inode table
+        break;
+      if (colour[v] == GREY) { // back on this chain, loop
+        if (rc == 0)
+          describe_loop(detail, len, path + pos[v], n - pos[v]);
+        for (uint k = pos[v]; g->rep && (k < n); k++)
+          report_add(g->rep, UNREACHABLE_DIR, path[k], NONE, -1,
+                     (k + 1 < n) ? path[k + 1] : v);
+        rc = -1;
+        break;
+      }
+      if (colour[v] == BLACK)
+        break;
+    }
+    while (n > 0)
+      colour[path[--n]] = BLACK;
+  }
+  return rc;
+}
+
+// helper for extra check #2
+// an inode with several .. entries makes the graph branch, and a chain fails
+// as soon as it reaches any inode twice, so each directory gets its own
+// depth-first walk on an explicit stack
+int walk_branches(struct dotdot_graph *g,
+                  struct scan *sc,
+                  int ninodes,
+                  char *detail,
+                  size_t len) {
+  uint *seen, *stack, *next;
+  uint u, t;
+  int i, top, k, rc;
+  rc = 0;
+
+  // a walk holds distinct inums, plus the directory it starts from again
+  seen = arena_alloc(g->nnodes*sizeof(uint));
+  stack = arena_alloc((g->nnodes + 1)*sizeof(uint));
+  next = arena_alloc((g->nnodes + 1)*sizeof(uint));
+
+  for (i = 0; i < ninodes; i++) {
+    if ((i % 4096 == 0) && stopped())
+      break;
+    if (inode_infos[i].type != T_DIR)
+      continue;
+
+    top = 0;
+    stack[0] = i;
+    next[0] = 0;
+    while (top >= 0) {
+      u = stack[top];
+      if (next[top] == g->count[u]) {
+        top--;
+        continue;
+      }
+
+      t = sc->dotdots[g->start[u] + next[top]++];
+      if (t >= g->nnodes) // past the inode table
+        continue;
+      if (seen[t] == i + 1) {
+        if (rc == 0) { // only the first failure is described
+          for (k = 0; (k <= top) && (stack[k] != t); k++)
+            ;
+          if (k <= top)
+            describe_loop(detail, len, stack + k, top - k + 1);
+          else
+            snprintf(detail, len, "  inode %u reached twice from inode %d.\n",
+                     t, i);
+        }
+        rc = -1;
+        if (g->rep != NULL)
+          report_add(g->rep, UNREACHABLE_DIR, i, NONE, -1, t);
+        break;
+      }
+      seen[t] = i + 1;
+      top++;
+      stack[top] = t;
+      next[top] = 0;
+    }
+    if ((rc < 0) && (g->rep == NULL))
+      break;
+  }
+  return rc;
+}
+
+// extra check #2
+// the .. graph is loaded once, then walked without recursion; rep is only
+// given by --all
+int check_no_loops(struct image *img,
+                   struct superblock *sb,
+                   struct scan *sc,
+                   char *detail,
+                   size_t len,
+                   struct report *rep) {
+  struct dotdot_graph g = { 0 };
+  uint *todo;
+  uint n, u, t, k;
+  int i, rc;
+
+  g.nnodes = sb->ninodes;
+  g.rep = rep;
+  size_t mark = arena_mark();
+  g.start = arena_alloc(g.nnodes*sizeof(uint));
+  g.count = arena_alloc(g.nnodes*sizeof(uint));
+  g.loaded = arena_alloc(g.nnodes*sizeof(char));
+  size_t loaded = arena_mark(); // the queue is done with once all are loaded
+  todo = arena_alloc(g.nnodes*sizeof(uint));
+
+  // every inode is loaded, and queued, at most once
+  n = 0;
+  for (i = 0; i < sb->ninodes; i++) {
+    if ((i % 4096 == 0) && stopped())
+      break;
+    if (inode_infos[i].type != T_DIR)
+      continue;
+    load_dotdots(img, sb, sc, &g, i);
+    todo[n++] = i;
+  }
+  while (n > 0) {
+    u = todo[--n];
+    for (k = 0; k < g.count[u]; k++) {
+      t = sc->dotdots[g.start[u] + k];
+      if ((t >= g.nnodes) || g.loaded[t])
+        continue;
+      load_dotdots(img, sb, sc, &g, t);
+      todo[n++] = t;
+    }
+  }
+  arena_release(loaded);
+
+  if (stopped()) // an earlier check failed, so the graph may be partial
+    rc = 0;
+  else if (!g.multi)
+    rc = walk_chains(&g, sc, sb->ninodes, detail, len);
+  else
+    rc = walk_branches(&g, sc, sb->ninodes, detail, len);
+
+  arena_release(mark);
+  return rc;
+}
+
+// --memory-limit
+// when the records of checks #7-12 do not fit in the memory given, the scan
+// keeps only the bitmaps. Checks #7 and #8 are then decided a range of block
+// numbers at a time and checks #9-12 a range of inode numbers at a time, each
+// range a pass of its own over the inode table, with records only for the
+// blocks or inodes in it. The failure reported is the one the checks find
+// with every record in memory
+
+// helper for --memory-limit, checks #7 and #8
+// the first repeated direct and indirect address among blocks [lo, hi), as a
+// single thread scanning the inode table would find it, taking the place of
+// the one in dup and idup if it comes first; *pos and *ipos are where in
+// its inode's addresses each was found
+void dups_in_range(struct image *img,
+                   struct superblock *sb,
+                   struct scan *sc,
+                   uint lo,
+                   uint hi,
+                   struct dup_addr *dup,
+                   uint *pos,
+                   struct dup_addr *idup,
+                   uint *ipos) {
+  struct block_owner *owners = arena_alloc((hi - lo)*
+                                           sizeof(struct block_owner));
+  struct dup_addr d = { 0 }, id = { 0 };
+  union block ibuf, buf;
+  struct dinode *dip = NULL;
+  uint *i_block, b, k, dpos = 0, idpos = 0;
+  int was;
+
+  for (uint i = 0; i < sb->ninodes; i++, dip++) {
+    // nothing past an inode that repeats an address can come before it
+    if ((d.found || (dup->found && (i > dup->inum[1]))) &&
+        (id.found || (idup->found && (i > idup->inum[1]))))
+      break;
+    if (i % IPB(sb->bsize) == 0)
+      dip = read_blocks(img, IBLOCK(i, sb), 1, &ibuf);
+    if (dip->type == 0) // inode not in use
+      continue;
+
+    for (k = 0; k < NDIRECT; k++) {
+      b = dip->addrs[k];
+      if ((b == 0) || (b < lo) || (b >= hi))
+        continue;
+      was = d.found;
+      claim_block(&owners[b - lo].direct, &d, b, i);
+      if (d.found && !was)
+        dpos = k;
+    }
+
+    if (dip->addrs[NDIRECT] == 0)
+      continue;
+    i_block = read_block(img, dip->addrs[NDIRECT], &buf);
+    sc->indirect_blocks++;
+    for (k = 0; k < NINDIRECT(sb->bsize); k++) {
+      b = i_block[k];
+      if ((b == 0) || (b < lo) || (b >= hi))
+        continue;
+      was = id.found;
+      claim_block(&owners[b - lo].indirect, &id, b, i);
+      if (id.found && !was)
+        idpos = k;
+    }
+  }
+
+  if (d.found && (!dup->found || (d.inum[1] < dup->inum[1]) ||
+                  ((d.inum[1] == dup->inum[1]) && (dpos < *pos)))) {
+    *dup = d;
+    *pos = dpos;
+  }
+  if (id.found && (!idup->found || (id.inum[1] < idup->inum[1]) ||
+                   ((id.inum[1] == idup->inum[1]) && (idpos < *ipos)))) {
+    *idup = id;
+    *ipos = idpos;
+  }
+}
+
+// --memory-limit, checks #7 and #8
+// the repeated addresses, found part_blocks blocks at a time
+void find_dups_partitioned(struct image *img,
+                           struct superblock *sb,
+                           struct scan *sc,
+                           uint part_blocks) {
+  uint pos = 0, ipos = 0, hi;
+
+  for (uint64_t lo = 0; lo < sb->size; lo += part_blocks) {
+    hi = (sb->size - lo > part_blocks) ? lo + part_blocks : sb->size;
+    size_t mark = arena_mark();
+    dups_in_range(img, sb, sc, lo, hi, &sc->direct_dup, &pos,
+                  &sc->indirect_dup, &ipos);
+    arena_release(mark);
+  }
+}
+
+// --memory-limit, checks #9-12 and extra check #1
+// the entries naming each inode in [lo, hi), counted into refs, each
+// directory being noted as the parent of the inodes it names as the scan
+// notes it; the .. entries of every directory are noted on the pass that
+// starts at inode 0
+void refs_in_range(struct image *img,
+                   struct superblock *sb,
+                   struct scan *sc,
+                   uint lo,
+                   uint hi,
+                   int *refs) {
+  union block ibuf, abuf, buf;
+  struct dinode *dip = NULL;
+  struct dirent *dirents, *block;
+  struct dirent_kinds kinds;
+  uint *i_block, b, child;
+
+  for (uint i = 0; i < sb->ninodes; i++, dip++) {
+    if (i % IPB(sb->bsize) == 0)
+      dip = read_blocks(img, IBLOCK(i, sb), 1, &ibuf);
+    if (inode_infos[i].type != T_DIR)
+      continue;
+
+    i_block = NULL;
+    if (dip->addrs[NDIRECT] != 0)
+      i_block = read_block(img, dip->addrs[NDIRECT], &abuf);
+    for (uint k = 0; k < MAXFILE(sb->bsize); k++) {
+      if (k >= NDIRECT)
+        b = (i_block != NULL) ? i_block[k - NDIRECT] : 0;
+      else
+        b = dip->addrs[k];
+      if (b == 0) // address not in use
+        continue;
+
+      dirents = read_block(img, b, &buf);
+      sc->dirent_blocks++;
+      for (block = dirents; block < dirents + DPB(sb->bsize);
+           block += DGROUP) {
+        classify_dirents(block, &kinds);
+        if (lo == 0)
+          note_dotdots(&inode_infos[i], block, &kinds, sb->ninodes);
+        for (uint32_t m = kinds.used & ~(kinds.dot | kinds.dotdot); m != 0;
+             m &= m - 1) {
+          child = block[__builtin_ctz(m)].inum;
+          if ((child < lo) || (child >= hi))
+            continue;
+          refs[child - lo]++;
+          inode_infos[child].parent = i;
+        }
+      }
+    }
+  }
+}
+
+// --all mode
+// a pass of its own over the inode table that keeps going past every failed
+// check; bad addresses are recorded, then dropped so nothing follows them
+
+// helper for --all
+// checks #1-5 on one in-use inode, recording every failure, plus everything
+// checks #6-12, E1 and E2 need
+void collect_inode(struct image *img,
+                   struct superblock *sb,
+                   struct dinode *node,
+                   uint inum,
+                   struct scan *sc,
+                   struct report *rep) {
+  union block buf;
+  uint addrs[NINDIRECT(MAXBSIZE)], *i_block = NULL;
+  uint b_addr;
+  int i, prev, dir_rc = 0;
+
+  // check #1
+  if (check_valid_inodes(node->type) < 0) {
+    report_add(rep, BAD_INODE, inum, NONE, -1, NONE);
+    return;
+  }
+
+  // check #2A
+  for (i = 0; i < NDIRECT; i++) {
+    if (node->addrs[i] >= sb->size) {
+      report_add(rep, BAD_DIRECT, inum, node->addrs[i], -1, NONE);
+      node->addrs[i] = 0;
+    }
+  }
+
+  // check #2B
+  b_addr = node->addrs[NDIRECT];
+  if (b_addr >= sb->size) {
+    report_add(rep, BAD_INDIRECT, inum, b_addr, -1, NONE);
+    node->addrs[NDIRECT] = 0;
+  } else if (b_addr != 0) {
+    i_block = memcpy(addrs, read_block(img, b_addr, &buf), sb->bsize);
+    sc->indirect_blocks++;
+    for (i = 0; i < NINDIRECT(sb->bsize); i++) {
+      if (i_block[i] >= sb->size) {
+        report_add(rep, BAD_INDIRECT, inum, i_block[i], -1, NONE);
+        i_block[i] = 0;
+      }
+    }
+  }
+
+  inode_infos[inum].type = node->type;
+  inode_infos[inum].nlink = node->nlink;
+
+  // checks #3 and #4
+  if (node->type == T_DIR)
+    dir_rc = check_valid_dir(img, node, i_block, inum, sb->ninodes, sc,
+                             sb->bsize);
+  if ((inum == ROOTINO) && ((node->type != T_DIR) || (dir_rc < 0)))
+    report_add(rep, NO_ROOT, inum, NONE, -1, NONE);
+  else if (dir_rc < 0)
+    report_add(rep, BAD_DIR, inum, NONE, -1, NONE);
+
+  // check #5, and the blocks in use for checks #6-8
+  for (i = 0; i <= NDIRECT; i++) {
+    b_addr = node->addrs[i];
+    if (b_addr == 0) // address not in use
+      continue;
+
+    SETBIT(sc->used, b_addr);
+    if (i == NDIRECT) // check #5 has never looked at the indirect block
+      continue;
+    if (!CHECKBIT(sc->bm, b_addr))
+      report_add(rep, BITMAP_FREE, inum, b_addr, -1, NONE);
+    if (sc->owners == NULL) // a quick check
+      continue;
+    if ((prev = sc->owners[b_addr].direct) != 0)
+      report_add(rep, DIRECT_REUSED, inum, b_addr, -1, prev - 1);
+    sc->owners[b_addr].direct = inum + 1;
+  }
+
+  if (i_block == NULL)
+    return;
+
+  for (i = 0; i < NINDIRECT(sb->bsize); i++) {
+    b_addr = i_block[i];
+    if (b_addr == 0) // address not in use
+      continue;
+
+    SETBIT(sc->used, b_addr);
+    if (!CHECKBIT(sc->bm, b_addr))
+      report_add(rep, BITMAP_FREE, inum, b_addr, -1, NONE);
+    if (sc->owners == NULL)
+      continue;
+    if ((prev = sc->owners[b_addr].indirect) != 0)
+      report_add(rep, INDIRECT_REUSED, inum, b_addr, -1, prev - 1);
+    sc->owners[b_addr].indirect = inum + 1;
+  }
+}
+
+// helper for --all
+// the dirents at fault for checks #10 and E1, which the pass only counted:
+// entries naming a free inode, and .. entries not naming the parent. They
+// are looked up in the directory graph and reported in the order of a walk
+// over the directory blocks, a group of DGROUP entries at a time with its ..
+// entries first
+void collect_dirents(struct superblock *sb,
+                     struct dir_graph *g,
+                     int free_refs,
+                     int parents,
+                     struct report *rep) {
+  struct dir_edge *run, *e, *d, *end;
+  uint parent;
+
+  for (uint i = 0; (i < sb->ninodes) && !report_full(rep); i++) {
+    if (inode_infos[i].type != T_DIR)
+      continue;
+
+    parent = (i == ROOTINO) ? ROOTINO : inode_infos[i].parent;
+    if (!free_refs && (!parents || (inode_infos[i].dotdot == parent)))
+      continue;
+
+    end = g->edge + g->row[i + 1];
+    for (run = g->edge + g->row[i]; run < end; run = e) {
+      for (e = run + 1; (e < end) && (e->block == run->block) &&
+           (e->off > e[-1].off) &&
+           (e->off / (DGROUP*sizeof(struct dirent)) ==
+            run->off / (DGROUP*sizeof(struct dirent))); e++)
+        ;
+
+      // extra check #1
+      for (d = run; parents && (d < e); d++)
+        if (d->dotdot && (inode_infos[i].dotdot != parent) &&
+            (d->child != parent))
+          report_add(rep, BAD_PARENT, i, d->block, d->off,
+                     (parent != 0) ? parent : NONE);
+
+      // check #10
+      for (d = run; free_refs && (d < e); d++)
+        if (!d->dotdot && (d->child < sb->ninodes) &&
+            (inode_infos[d->child].type == 0))
+          report_add(rep, REF_FREE, d->child, d->block, d->off, i);
+    }
+  }
+}
+
+// every check of the tier of sc on the whole image, each failure recorded in
+// rep until it is full; returns the number of failures
+uint64_t collect_all(struct image *img,
+                     struct superblock *sb,
+                     struct scan *sc,
+                     uint db1,
+                     struct report *rep) {
+  union block ibuf;
+  struct dinode node, *dip = NULL;
+  uint nused = (sb->size > sb->dataend) ? sb->size : sb->dataend;
+  uint64_t *bm = (uint64_t *) sc->bm;
+  int free_refs = 0;
+  char detail[256];
+
+  sc->used = arena_alloc(BITWORDS(nused)*sizeof(uint64_t));
+  if (sc->tier != TIER_QUICK) {
+    sc->owners = arena_alloc(sb->size*sizeof(struct block_owner));
+    sc->refs = arena_alloc(sb->ninodes*sizeof(int));
+    graph_init(&sc->graph, sb->ninodes);
+  }
+
+  // checks #1-5, #7 and #8
+  for (uint i = 0; (i < sb->ninodes) && !report_full(rep); i++, dip++) {
+    if (i % IPB(sb->bsize) == 0)
+      dip = read_blocks(img, IBLOCK(i, sb), 1, &ibuf);
+    node = *dip;
+    if (node.type == 0) // not in use, the root included, as in the scan
+      continue;
+    sc->inodes++;
+    collect_inode(img, sb, &node, i, sc, rep);
+  }
+  if (sc->tier != TIER_QUICK) {
+    graph_count(&sc->graph, sc);
+    graph_place(&sc->graph, sb->ninodes);
+    graph_fill(&sc->graph, sc);
+    graph_done(&sc->graph, sb->ninodes);
+  }
+
+  // check #6, skipping a word at a time where nothing differs
+  for (uint64_t b = db1; (b < sb->dataend) && !report_full(rep); b++) {
+    if ((bm[b / 64] & ~sc->used[b / 64]) == 0) {
+      b |= 63;
+      continue;
+    }
+    if (CHECKBIT(sc->bm, b) && !((sc->used[b / 64] >> (b % 64)) & 1))
+      report_add(rep, BITMAP_UNUSED, NONE, b, -1, NONE);
+  }
+  if ((sc->tier == TIER_QUICK) || report_full(rep))
+    return rep->total;
+
+  // checks #9-12
+  for (uint i = 2; (i < sb->ninodes) && !report_full(rep); i++) {
+    struct inode_info *info = &inode_infos[i];
+    if ((info->type != 0) && (sc->refs[i] == 0))
+      report_add(rep, NOT_IN_DIR, i, NONE, -1, NONE);
+    if ((sc->refs[i] != 0) && (info->type == 0))
+      free_refs = 1; // recorded per dirent below
+    if ((info->type == T_FILE) && (info->nlink != sc->refs[i]))
+      report_add(rep, BAD_REFCOUNT, i, NONE, -1, NONE);
+    if ((info->type == T_DIR) && (sc->refs[i] > 1))
+      report_add(rep, DIR_REPEATED, i, NONE, -1, NONE);
+  }
+
+  // checks #10 and E1
+  collect_dirents(sb, &sc->graph, free_refs, (sc->tier == TIER_THOROUGH),
+                  rep);
+  if ((sc->tier != TIER_THOROUGH) || report_full(rep))
+    return rep->total;
+
+  // extra check #2
+  check_no_loops(img, sb, sc, detail, sizeof(detail), rep);
+  return rep->total;
+}
+
+// helper for --all
+// the path of the inode at fault, for check #10 the path of the entry at
+// fault; returns -1 if it has none
+int violation_path(struct report *rep,
+                   struct violation *v,
+                   char *path,
+                   size_t len) {
+  struct dir_graph *g = rep->graph;
+
+  if ((g == NULL) || (g->row == NULL) || (v->inum == NONE))
+    return -1;
+  if ((v->err == REF_FREE) && (v->other != NONE))
+    return entry_path(rep->img, rep->sb, g,
+                      (struct entry_at) { v->other, v->block, v->offset },
+                      path, len);
+  return inode_path(rep->img, rep->sb, g, v->inum, path, len);
+}
+
+// helper for --all
+// s as a JSON string; bytes past ASCII are escaped one at a time, as names
+// need not be UTF-8
+void json_string(FILE *out, const char *s) {
+  fputc('"', out);
+  for (; *s != '\0'; s++) {
+    unsigned char c = *s;
+    if ((c == '"') || (c == '\\'))
+      fprintf(out, "\\%c", c);
+    else if ((c < 0x20) || (c >= 0x7f))
+      fprintf(out, "\\u%04x", c);
+    else
+      fputc(c, out);
+  }
+  fputc('"', out);
+}
+
+// the --all report, one JSON object per line and a summary last; other is
+// the earlier owner of the block for checks #7 and #8, the directory holding
+// the dirent for check #10 and the parent for E1 and E2
+void report_write(FILE *out, struct report *rep) {
+  char path[PATH_DEPTH*(DIRSIZ + 1) + 1];
+
+  for (uint i = 0; i < rep->n; i++) {
+    struct violation *v = &rep->v[i];
+    char *msg = errors[v->err] + strlen("ERROR: ");
+
+    fprintf(out, "{\"check\":\"%s\",\"error\":\"%.*s\"",
+            check_ids[v->err], (int) strlen(msg) - 1, msg);
+    if (v->inum != NONE)
+      fprintf(out, ",\"inode\":%u", v->inum);
+    if (v->block != NONE)
+      fprintf(out, ",\"block\":%u", v->block);
+    if (v->offset >= 0)
+      fprintf(out, ",\"offset\":%d", v->offset);
+    if (v->other != NONE) {
+      char *key = "parent";
+      if ((v->err == DIRECT_REUSED) || (v->err == INDIRECT_REUSED))
+        key = "also_used_by";
+      else if (v->err == REF_FREE)
+        key = "directory";
+      fprintf(out, ",\"%s\":%u", key, v->other);
+    }
+    if (violation_path(rep, v, path, sizeof(path)) == 0) {
+      fprintf(out, ",\"path\":");
+      json_string(out, path);
+    }
+    fprintf(out, "}\n");
+  }
+  fprintf(out, "{\"violations\":%lu,\"reported\":%u%s}\n",
+          (unsigned long) rep->total, rep->n,
+          report_full(rep) ? ",\"stopped\":true" : "");
+}
+
+// incremental mode
+// a summary of the image is kept in a file between runs: a hash of each inode
+// block and of every block its inodes lead the scan to, what the inodes of
+// each inode block contribute, and the state checks #5-12, E1 and E2 are
+// decided from. Only inode blocks whose hashes changed are scanned again,
+// their old contributions taken out of the state and the new ones put in
+
+#define SUMMARY_MAGIC "xv6fsum"
+#define SUMMARY_VERSION 2
+
+struct summary_header {
+  char magic[8];
+  uint version;
+  struct superblock sb;
+  uint nregions;       // inode blocks
+  uint64_t nfacts;
+  uint64_t nreads;
+};
+
+// an inode block and what scanning its inodes found
+struct region {
+  uint64_t hash;       // of the inode block
+  uint64_t fact_start; // index of first fact in summary.facts
+  uint64_t read_start; // index of first block hash in summary.reads
+  uint nfacts;
+  uint nreads;         // indirect and directory blocks of its inodes
+  int err;             // first of checks #1-4 failed in the block, or OK
+};
+
+struct block_hash {
+  uint block;
+  uint64_t hash;
+};
+
+// how many times each block is used, by kind of address; unlike
+// block_owner these can be taken back when an inode changes. A count that
+// reaches USES_MAX stays there, and taking one back from it means the whole
+// summary has to be built again
+struct block_uses {
+  uint8_t direct;
+  uint8_t indirect;
+  uint8_t iblock;
+};
+
+#define USES_MAX 255
+
+// the part of inode_info kept in the summary; the rest is rebuilt each run
+struct inode_summary {
+  short type;
+  short nlink;
+  uint dotdot;
+};
+
+struct summary {
+  struct summary_header h;
+  struct region *regions;
+  struct fact_log facts;
+  struct block_hash *reads;
+  uint64_t nreads, reads_cap;
+  struct block_uses *uses; // checks #5-8
+  int *refs;               // checks #9-12, as scan.refs
+  uint *namers;            // E1, sum of the directories naming each inode
+  int fresh;               // nothing was loaded, every region is scanned
+  int changed;             // some region was scanned again
+  int overflow;            // a block use was taken back from USES_MAX
+};
+
+// a 64-bit hash of a block of bsize bytes, quick to compute and meant to
+// notice changes, not to withstand someone making two blocks collide
+uint64_t hash_block(const void *block, uint bsize) {
+  const uint64_t p1 = 0x9e3779b97f4a7c15ULL, p2 = 0xc2b2ae3d27d4eb4fULL;
+  uint64_t h[4] = { p1, p2, ~p1, ~p2 };
+  uint64_t w[4], x;
+
+  // four independent lanes, so the multiplies overlap
+  for (uint i = 0; i < bsize; i += sizeof(w)) {
+    memcpy(w, (const char *) block + i, sizeof(w));
+    for (int k = 0; k < 4; k++) {
+      h[k] = (h[k] ^ w[k]) * p1;
+      h[k] ^= h[k] >> 29;
+    }
+  }
+  x = h[0] ^ (h[1] * p2) ^ ((h[2] << 17) | (h[2] >> 47)) ^ (h[3] * p1);
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  return x;
+}
+
+void add_read(struct summary *s, uint block, const void *data) {
+  if (s->nreads == s->reads_cap) {
+    s->reads_cap = s->reads_cap ? 2*s->reads_cap : 1024;
+    s->reads = realloc(s->reads, s->reads_cap*sizeof(struct block_hash));
+    if (s->reads == NULL)
+      die();
+  }
+  s->reads[s->nreads++] =
+    (struct block_hash) { block, hash_block(data, s->h.sb.bsize) };
+}
+
+// an empty summary for an image with superblock sb
+void init_summary(struct summary *s, struct superblock *sb) {
+  memset(s, 0, sizeof(struct summary));
+  memcpy(s->h.magic, SUMMARY_MAGIC, sizeof(s->h.magic));
+  s->h.version = SUMMARY_VERSION;
+  s->h.sb = *sb;
+  s->h.nregions = (sb->ninodes + IPB(sb->bsize) - 1) / IPB(sb->bsize);
+  s->fresh = 1;
+  if (((s->regions = calloc(s->h.nregions, sizeof(struct region))) == NULL) ||
+      ((s->uses = calloc(sb->size, sizeof(struct block_uses))) == NULL) ||
+      ((s->refs = calloc(sb->ninodes, sizeof(int))) == NULL) ||
+      ((s->namers = calloc(sb->ninodes, sizeof(uint))) == NULL))
+    die();
+}
+
+void free_summary(struct summary *s) {
+  free(s->regions);
+  free(s->facts.f);
+  free(s->reads);
+  free(s->uses);
+  free(s->refs);
+  free(s->namers);
+}
+
+// helper for incremental mode
+// every index in a loaded summary must be in range before it is followed
+int summary_valid(struct summary *s) {
+  struct superblock *sb = &s->h.sb;
+  struct region *r;
+  struct fact *f;
+
+  for (uint i = 0; i < s->h.nregions; i++) {
+    r = &s->regions[i];
+    if ((r->fact_start > s->facts.n) || (r->nfacts > s->facts.n - r->fact_start) ||
+        (r->read_start > s->nreads) || (r->nreads > s->nreads - r->read_start))
+      return -1;
+  }
+  for (uint64_t i = 0; i < s->facts.n; i++) {
+    f = &s->facts.f[i];
+    if (f->inum >= sb->ninodes)
+      return -1;
+    switch (f->kind) {
+      case F_DIRECT :
+      case F_INDIRECT :
+      case F_IBLOCK :
+        if (f->value >= sb->size)
+          return -1;
+        break;
+      case F_NAME :
+        if (f->value >= sb->ninodes)
+          return -1;
+        break;
+      case F_DOTDOT :
+        if ((f->value < 2) || (f->value > 0xffff))
+          return -1;
+        break;
+      default :
+        return -1;
+    }
+  }
+  for (uint64_t i = 0; i < s->nreads; i++)
+    if (s->reads[i].block >= sb->size)
+      return -1;
+  return 0;
+}
+
+// the summary kept in path for an image with superblock sb, or an empty one
+// if there is none, it is for an image of another shape, or it is damaged;
+// inode_infos is loaded along with it
+void load_summary(char *path, struct superblock *sb, struct summary *s) {
+  struct summary_header h;
+  struct inode_summary *inodes = NULL;
+  struct stat sbuf;
+  FILE *f;
+  uint64_t len;
+
+  init_summary(s, sb);
+  if ((f = fopen(path, "r")) == NULL)
+    return;
+  if ((fread(&h, sizeof(h), 1, f) != 1) ||
+      (memcmp(&h.magic, &s->h.magic, sizeof(h.magic)) != 0) ||
+      (h.version != s->h.version) ||
+      (memcmp(&h.sb, sb, sizeof(struct superblock)) != 0) ||
+      (h.nregions != s->h.nregions) ||
+      (fstat(fileno(f), &sbuf) != 0))
+    goto stale;
+
+  // the arrays must fill the rest of the file exactly
+  len = sizeof(h) + (uint64_t) h.nregions*sizeof(struct region) +
+        (uint64_t) sb->size*sizeof(struct block_uses) +
+        (uint64_t) sb->ninodes*(sizeof(int) + sizeof(uint) +
+                                sizeof(struct inode_summary));
+  if (((uint64_t) sbuf.st_size < len) ||
+      ((sbuf.st_size - len) / sizeof(struct fact) < h.nfacts) ||
+      (sbuf.st_size - len - h.nfacts*sizeof(struct fact) !=
+       h.nreads*sizeof(struct block_hash)))
+    goto stale;
+
+  s->facts.n = s->facts.cap = h.nfacts;
+  s->nreads = s->reads_cap = h.nreads;
+  if (((s->facts.f = malloc(h.nfacts*sizeof(struct fact) + 1)) == NULL) ||
+      ((s->reads = malloc(h.nreads*sizeof(struct block_hash) + 1)) == NULL) ||
+      ((inodes = malloc(sb->ninodes*sizeof(struct inode_summary))) == NULL))
+    die();
+  if ((fread(s->regions, sizeof(struct region), h.nregions, f) !=
+       h.nregions) ||
+      (fread(s->facts.f, sizeof(struct fact), h.nfacts, f) != h.nfacts) ||
+      (fread(s->reads, sizeof(struct block_hash), h.nreads, f) != h.nreads) ||
+      (fread(s->uses, sizeof(struct block_uses), sb->size, f) != sb->size) ||
+      (fread(s->refs, sizeof(int), sb->ninodes, f) != sb->ninodes) ||
+      (fread(s->namers, sizeof(uint), sb->ninodes, f) != sb->ninodes) ||
+      (fread(inodes, sizeof(struct inode_summary), sb->ninodes, f) !=
+       sb->ninodes) ||
+      (summary_valid(s) < 0))
+    goto stale;
+
+  for (uint i = 0; i < sb->ninodes; i++) {
+    inode_infos[i].type = inodes[i].type;
+    inode_infos[i].nlink = inodes[i].nlink;
+    inode_infos[i].dotdot = inodes[i].dotdot;
+  }
+  s->fresh = 0;
+  free(inodes);
+  fclose(f);
+  return;
+
+ stale: ;
+  free(inodes);
+  fclose(f);
+  free_summary(s);
+  init_summary(s, sb);
+  memset(inode_infos, 0, sb->ninodes*sizeof(struct inode_info));
+}
+
+// write the summary to path, through a temporary file so that a run cut
+// short never leaves half a summary behind; the facts and hashes of regions
+// scanned again were appended, so they are put back in order on the way
+void save_summary(char *path, struct summary *s) {
+  struct superblock *sb = &s->h.sb;
+  struct inode_summary node;
+  struct region r;
+  char tmp[4096];
+  FILE *f;
+  uint i;
+
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp))
+    die();
+  if ((f = fopen(tmp, "w")) == NULL)
+    die();
+
+  s->h.nfacts = s->h.nreads = 0;
+  for (i = 0; i < s->h.nregions; i++) {
+    s->h.nfacts += s->regions[i].nfacts;
+    s->h.nreads += s->regions[i].nreads;
+  }
+  if (fwrite(&s->h, sizeof(s->h), 1, f) != 1)
+    die();
+
+  uint64_t nfacts = 0, nreads = 0;
+  for (i = 0; i < s->h.nregions; i++) {
+    r = s->regions[i];
+    r.fact_start = nfacts;
+    r.read_start = nreads;
+    nfacts += r.nfacts;
+    nreads += r.nreads;
+    if (fwrite(&r, sizeof(r), 1, f) != 1)
+      die();
+  }
+  // a region may hold none, and the tables may then not be there at all
+  for (i = 0; i < s->h.nregions; i++) {
+    r = s->regions[i];
+    if ((r.nfacts != 0) &&
+        (fwrite(s->facts.f + r.fact_start, sizeof(struct fact), r.nfacts,
+                f) != r.nfacts))
+      die();
+  }
+  for (i = 0; i < s->h.nregions; i++) {
+    r = s->regions[i];
+    if ((r.nreads != 0) &&
+        (fwrite(s->reads + r.read_start, sizeof(struct block_hash), r.nreads,
+                f) != r.nreads))
+      die();
+  }
+  if ((fwrite(s->uses, sizeof(struct block_uses), sb->size, f) != sb->size) ||
+      (fwrite(s->refs, sizeof(int), sb->ninodes, f) != sb->ninodes) ||
+      (fwrite(s->namers, sizeof(uint), sb->ninodes, f) != sb->ninodes))
+    die();
+  for (i = 0; i < sb->ninodes; i++) {
+    node = (struct inode_summary) { inode_infos[i].type, inode_infos[i].nlink,
+                                    inode_infos[i].dotdot };
+    if (fwrite(&node, sizeof(node), 1, f) != 1)
+      die();
+  }
+  if ((fclose(f) != 0) || (rename(tmp, path) != 0))
+    die();
+}
+
+// helper for incremental mode
+// add (sign 1) or take out (sign -1) what region r contributes to the state
+void apply_region(struct summary *s, struct region *r, int sign) {
+  struct fact *f = s->facts.f + r->fact_start;
+  uint8_t *count;
+
+  for (uint k = 0; k < r->nfacts; k++, f++) {
+    switch (f->kind) {
+      case F_DIRECT :
+        count = &s->uses[f->value].direct;
+        break;
+      case F_INDIRECT :
+        count = &s->uses[f->value].indirect;
+        break;
+      case F_IBLOCK :
+        count = &s->uses[f->value].iblock;
+        break;
+      case F_NAME :
+        // sums wrap, but the one namer of an inode named once is exact
+        s->refs[f->value] += sign;
+        s->namers[f->value] += sign*f->inum;
+        continue;
+      default :
+        continue;
+    }
+    if (*count == USES_MAX)
+      s->overflow |= (sign < 0);
+    else
+      *count += sign;
+  }
+}
+
+// helper for incremental mode
+// hash the indirect blocks of the in-use inodes in an inode block, and every
+// data block of its directories: all the scan of the block can read
+void add_region_reads(struct image *img,
+                      struct summary *s,
+                      struct dinode *dip,
+                      uint n) {
+  uint size = s->h.sb.size;
+  union block ibuf, buf;
+  uint *i_block, b_addr;
+
+  for (uint i = 0; i < n; i++, dip++) {
+    if (dip->type == 0) // unallocated inode, skip
+      continue;
+
+    i_block = NULL;
+    b_addr = dip->addrs[NDIRECT];
+    if ((b_addr != 0) && (b_addr < size)) {
+      i_block = read_block(img, b_addr, &ibuf);
+      add_read(s, b_addr, i_block);
+    }
+    if (dip->type != T_DIR)
+      continue;
+
+    for (int k = 0; k < MAXFILE(s->h.sb.bsize); k++) {
+      if ((k >= NDIRECT) && (i_block == NULL))
+        break;
+      b_addr = (k < NDIRECT) ? dip->addrs[k] : i_block[k - NDIRECT];
+      if ((b_addr != 0) && (b_addr < size))
+        add_read(s, b_addr, read_block(img, b_addr, &buf));
+    }
+  }
+}
+
+// helper for incremental mode
+// whether region r, whose inode block is at dip, is as it was last scanned
+int region_unchanged(struct image *img,
+                     struct summary *s,
+                     struct region *r,
+                     struct dinode *dip) {
+  struct block_hash *rb = s->reads + r->read_start;
+  uint bsize = s->h.sb.bsize;
+  union block buf;
+
+  if (s->fresh || (hash_block(dip, bsize) != r->hash))
+    return 0;
+  for (uint k = 0; k < r->nreads; k++, rb++)
+    if (hash_block(read_block(img, rb->block, &buf), bsize) != rb->hash)
+      return 0;
+  return 1;
+}
+
+// helper for incremental mode
+// scan the inodes of inode block b again, with t as scratch space
+void rescan_region(struct image *img,
+                   struct superblock *sb,
+                   struct summary *s,
+                   struct scan *t,
+                   uint b,
+                   struct dinode *dip) {
+  struct region *r = &s->regions[b];
+  uint first = b*IPB(sb->bsize);
+  uint last = (first + IPB(sb->bsize) < sb->ninodes) ?
+              first + IPB(sb->bsize) : sb->ninodes;
+  int err;
+
+  apply_region(s, r, -1);
+  memset(&inode_infos[first], 0, (last - first)*sizeof(struct inode_info));
+
+  r->hash = hash_block(dip, sb->bsize);
+  r->err = OK;
+  r->fact_start = s->facts.n;
+  t->ndotdots = 0;
+  for (uint i = first; i < last; i++) {
+    if (dip[i - first].type == 0) // unallocated inode, skip
+      continue;
+    err = scan_inode(img, sb, &dip[i - first], i, t, sb->bsize);
+    if ((err != OK) && (r->err == OK))
+      r->err = err;
+  }
+  r->nfacts = s->facts.n - r->fact_start;
+  apply_region(s, r, 1);
+
+  r->read_start = s->nreads;
+  add_region_reads(img, s, dip, last - first);
+  r->nreads = s->nreads - r->read_start;
+  s->changed = 1;
+}
+
+// helper for incremental mode
+// a thread hashing the regions [lo, hi) to find those that changed
+struct hash_job {
+  pthread_t tid;
+  struct image *img;
+  struct summary *s;
+  uint lo, hi;
+  char *changed;
+  char *win_buf;         // inode blocks read at once when streaming
+};
+
+void *find_changed(void *arg) {
+  struct hash_job *job = arg;
+  char *win;
+  uint n;
+
+  for (uint b = job->lo; b < job->hi; b += n) {
+    n = (job->hi - b < IWINDOW) ? job->hi - b : IWINDOW;
+    win = read_blocks(job->img, job->s->h.sb.inodestart + b, n,
+                      job->win_buf);
+    for (uint k = 0; k < n; k++)
+      job->changed[b + k] =
+        !region_unchanged(job->img, job->s, &job->s->regions[b + k],
+                          (struct dinode *) (win + k*job->img->bsize));
+  }
+  return NULL;
+}
+
+// helper for incremental mode
+// bring the summary up to date with the image, hashing with nthreads
+// threads and scanning what changed with one; sc only gets the counters
+void update_summary(struct image *img,
+                    struct superblock *sb,
+                    struct summary *s,
+                    int nthreads,
+                    struct scan *sc) {
+  uint niblocks = s->h.nregions;
+  uint nused = (sb->size > sb->dataend) ? sb->size : sb->dataend;
+  struct hash_job *jobs;
+  struct scan t = { 0 };
+  union block buf;
+  char *changed;
+  int i;
+
+  size_t mark = arena_mark();
+  changed = arena_alloc(niblocks + 1);
+  jobs = arena_alloc(nthreads*sizeof(struct hash_job));
+  for (i = 0; i < nthreads; i++) {
+    if (img->mem == NULL)
+      jobs[i].win_buf = arena_alloc(IWINDOW*sb->bsize);
+    jobs[i].img = img;
+    jobs[i].s = s;
+    jobs[i].lo = (uint) ((unsigned long) niblocks * i / nthreads);
+    jobs[i].hi = (uint) ((unsigned long) niblocks * (i + 1) / nthreads);
+    jobs[i].changed = changed;
+  }
+  if (s->fresh) {
+    memset(changed, 1, niblocks);
+  } else if (nthreads == 1) {
+    find_changed(&jobs[0]);
+  } else {
+    for (i = 0; i < nthreads; i++)
+      if (pthread_create(&jobs[i].tid, NULL, find_changed, &jobs[i]) != 0)
+        die();
+    for (i = 0; i < nthreads; i++)
+      pthread_join(jobs[i].tid, NULL);
+  }
+
+  t.bm = sc->bm;
+  t.facts = &s->facts;
+  for (uint b = 0; b < niblocks; b++) {
+    if (!changed[b])
+      continue;
+
+    // scratch space for scan_inode, of which only the facts are kept
+    if (t.refs == NULL) {
+      t.used = arena_alloc(BITWORDS(nused)*sizeof(uint64_t));
+      t.used_addrs = arena_alloc(BITWORDS(nused)*sizeof(uint64_t));
+      t.owners = arena_alloc(sb->size*sizeof(struct block_owner));
+      t.refs = arena_alloc(sb->ninodes*sizeof(int));
+    }
+    rescan_region(img, sb, s, &t, b,
+                  read_blocks(img, sb->inodestart + b, 1, &buf));
+  }
+
+  sc->inodes += t.inodes;
+  sc->dirent_blocks += t.dirent_blocks;
+  sc->indirect_blocks += t.indirect_blocks;
+  free(t.dotdots);
+  arena_release(mark);
+}
+
+// helper for incremental mode
+// fill sc from the summary as scan_inodes would have; returns -1 if some
+// inode failed checks #1-5, so that the scan can find which one
+int use_summary(struct image *img,
+                struct superblock *sb,
+                struct summary *s,
+                struct scan *sc,
+                uint db1) {
+  uint nused = (sb->size > sb->dataend) ? sb->size : sb->dataend;
+  struct block_uses *u;
+  struct fact *f;
+  struct region *r;
+
+  for (uint i = 0; i < s->h.nregions; i++)
+    if (s->regions[i].err != OK)
+      return -1;
+
+  // checks #5-8
+  sc->used = arena_alloc(BITWORDS(nused)*sizeof(uint64_t));
+  sc->used_addrs = arena_alloc(BITWORDS(nused)*sizeof(uint64_t));
+  for (uint b = 0; b < sb->size; b++) {
+    u = &s->uses[b];
+    if ((u->direct | u->indirect | u->iblock) == 0)
+      continue;
+    SETBIT(sc->used, b);
+    if (u->direct | u->indirect)
+      SETBIT(sc->used_addrs, b);
+    if (u->direct > 1)
+      sc->direct_dup.found = 1;
+    if (u->indirect > 1)
+      sc->indirect_dup.found = 1;
+  }
+  reconcile_bitmap(sb, sc, db1);
+  if (sc->bits.missing > 0)
+    return -1;
+
+  // checks #9-12 and E1; a directory named once has that one as its parent
+  sc->refs = arena_alloc(sb->ninodes*sizeof(int));
+  memcpy(sc->refs, s->refs, sb->ninodes*sizeof(int));
+  for (uint i = 0; i < sb->ninodes; i++) {
+    inode_infos[i].parent = (sc->refs[i] == 1) ? s->namers[i] : 0;
+    inode_infos[i].dd_count = 0;
+  }
+
+  // E2, the .. entries in inode order
+  for (uint i = 0; i < s->h.nregions; i++) {
+    r = &s->regions[i];
+    f = s->facts.f + r->fact_start;
+    for (uint k = 0; k < r->nfacts; k++, f++) {
+      if (f->kind != F_DOTDOT)
+        continue;
+      if (inode_infos[f->inum].dd_count++ == 0)
+        inode_infos[f->inum].dd_start = sc->ndotdots;
+      add_dotdot(sc, f->value);
+    }
+  }
+
+  // checks #7 and #8 are only told apart from the image
+  sc->owners = arena_alloc(sb->size*sizeof(struct block_owner));
+  if (sc->direct_dup.found || sc->indirect_dup.found)
+    find_first_dup(img, sb, sc);
+  return OK;
+}
+
+// checks #1-5 through the summary kept in path, which is brought up to date;
+// returns OK with sc filled as scan_inodes would fill it, or -1 with sc and
+// inode_infos cleared, when scan_inodes has to say which check failed
+int check_incremental(struct image *img,
+                      struct superblock *sb,
+                      int nthreads,
+                      struct scan *sc,
+                      char *path,
+                      uint db1) {
+  struct summary s;
+  size_t mark = arena_mark();
+  int rc;
+
+  load_summary(path, sb, &s);
+  update_summary(img, sb, &s, nthreads, sc);
+  if (s.overflow) { // start over
+    free_summary(&s);
+    init_summary(&s, sb);
+    memset(inode_infos, 0, sb->ninodes*sizeof(struct inode_info));
+    update_summary(img, sb, &s, nthreads, sc);
+  }
+  if (s.fresh || s.changed)
+    save_summary(path, &s);
+
+  rc = use_summary(img, sb, &s, sc, db1);
+  free_summary(&s);
+  if (rc < 0) {
+    free(sc->dotdots);
+    arena_release(mark);
+    *sc = (struct scan) { .bm = sc->bm };
+    memset(inode_infos, 0, sb->ninodes*sizeof(struct inode_info));
+  }
+  return rc;
+}
+
+// --stats
+// what each stage of the checker cost; counters in struct scan and struct
+// image are always kept, everything else is only sampled when stats are on
+struct stage_stats {
+  char *name;
+  double wall, cpu;         // seconds
+  uint64_t inodes, dirent_blocks, indirect_blocks;
+  uint64_t bytes_read;      // by pread, 0 when the image is mapped
+  uint64_t bytes_written;   // to the image by repair
+  long minor_faults, major_faults;
+  size_t heap;              // bytes allocated when the stage ended
+};
+
+#define MAX_STAGES 8
+
+struct stats {
+  int on;
+  int overlap;              // stages run at once, so cpu time is per thread
+  int n;
+  struct stage_stats stages[MAX_STAGES];
+  char *current;            // stage begun but not yet ended, if any
+  struct stage_stats start; // counters when the current stage began
+  struct timespec t0, cpu0;
+  struct rusage r0;
+  size_t scratch;           // arena reserved, and the most of it used
+  size_t scratch_peak;
+};
+
+double seconds(struct timeval tv) {
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+double elapsed(struct timespec t0, struct timespec t1) {
+  return (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+size_t heap_in_use(void) {
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || (__GLIBC_MINOR__ >= 33))
+  struct mallinfo2 mi = mallinfo2();
+  return mi.uordblks + mi.hblkhd;
+#else
+  return 0;
+#endif
+}
+
+void stage_begin(struct stats *st,
+                 char *name,
+                 struct image *img,
+                 struct scan *sc) {
+  if (!st->on)
+    return;
+  st->current = name;
+  if (sc != NULL) {
+    st->start.inodes = sc->inodes;
+    st->start.dirent_blocks = sc->dirent_blocks;
+    st->start.indirect_blocks = sc->indirect_blocks;
+  }
+  st->start.bytes_read = (img != NULL) ? img->bytes_read : 0;
+  st->start.bytes_written = (img != NULL) ? img->bytes_written : 0;
+  getrusage(RUSAGE_SELF, &st->r0);
+  if (st->overlap)
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &st->cpu0);
+  clock_gettime(CLOCK_MONOTONIC, &st->t0);
+}
+
+// end the current stage, if there is one
+void stage_end(struct stats *st, struct image *img, struct scan *sc) {
+  struct timespec t1, cpu1;
+  struct rusage r1;
+  struct stage_stats *s;
+
+  if ((st->current == NULL) || (st->n == MAX_STAGES))
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  getrusage(RUSAGE_SELF, &r1);
+
+  s = &st->stages[st->n++];
+  s->name = st->current;
+  st->current = NULL;
+  s->wall = elapsed(st->t0, t1);
+  s->cpu = seconds(r1.ru_utime) + seconds(r1.ru_stime) -
+           seconds(st->r0.ru_utime) - seconds(st->r0.ru_stime);
+  if (st->overlap) {
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu1);
+    s->cpu = elapsed(st->cpu0, cpu1);
+  }
+  s->minor_faults = r1.ru_minflt - st->r0.ru_minflt;
+  s->major_faults = r1.ru_majflt - st->r0.ru_majflt;
+  if (sc != NULL) {
+    s->inodes = sc->inodes - st->start.inodes;
+    s->dirent_blocks = sc->dirent_blocks - st->start.dirent_blocks;
+    s->indirect_blocks = sc->indirect_blocks - st->start.indirect_blocks;
+  }
+  if (img != NULL) {
+    s->bytes_read = img->bytes_read - st->start.bytes_read;
+    s->bytes_written = img->bytes_written - st->start.bytes_written;
+  }
+  s->heap = heap_in_use() + scratch.used;
+}
+
+// one JSON object on a line of its own, after any --all report
+void stats_write(FILE *out, struct stats *st) {
+  fprintf(out, "{\"stats\":[");
+  for (int i = 0; i < st->n; i++) {
+    struct stage_stats *s = &st->stages[i];
+    fprintf(out, "%s{\"stage\":\"%s\",\"wall_s\":%.6f,\"cpu_s\":%.6f,"
+                 "\"inodes\":%lu,\"dirent_blocks\":%lu,"
+                 "\"indirect_blocks\":%lu,\"bytes_read\":%lu,"
+                 "\"bytes_written\":%lu,"
+                 "\"minor_faults\":%ld,\"major_faults\":%ld,"
+                 "\"heap_bytes\":%lu}",
+            (i > 0) ? "," : "", s->name, s->wall, s->cpu,
+            (unsigned long) s->inodes, (unsigned long) s->dirent_blocks,
+            (unsigned long) s->indirect_blocks,
+            (unsigned long) s->bytes_read, (unsigned long) s->bytes_written,
+            s->minor_faults, s->major_faults, (unsigned long) s->heap);
+  }
+  fprintf(out, "],\"scratch_bytes\":%lu,\"scratch_peak_bytes\":%lu}\n",
+          (unsigned long) st->scratch, (unsigned long) st->scratch_peak);
+}
+
+// repair
+// lost inodes (check #9) are named in lost_found, which is made if the root
+// does not name one, and the bitmap is made to agree with the blocks in use
+// (checks #5 and #6). Every change is worked out in memory first; the blocks
+// it changes are then saved as they were to an undo log beside the image,
+// and only once that is synced are they written, one pwrite each (a block
+// of zeros is punched out as a hole instead), and the image synced. The log
+// is removed last, so a log found by the next repair belongs to one that did
+// not finish and is played back before it starts
+
+#define UNDO_MAGIC "xv6fundo"
+#define UNDO_VERSION 2
+
+struct undo_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t nblocks;     // records that follow
+  uint32_t bsize;       // of the image
+  uint32_t unused;
+  uint64_t sum;         // of the records, to tell a log cut short
+};
+
+// a block as it was before the repair; only bsize bytes of data are logged
+struct undo_record {
+  uint32_t block;
+  char data[MAXBSIZE];
+};
+
+#define UNDO_RECORD_SIZE(bs) (sizeof(struct undo_record) - MAXBSIZE + (bs))
+
+// a block changed by the repair; the contents come first, so that they are
+// as aligned as malloc makes them
+struct dirty_block {
+  char data[MAXBSIZE];
+  char old[MAXBSIZE];
+  uint block;
+};
+
+struct repair {
+  struct image *img;
+  struct superblock *sb;
+  struct scan *sc;
+  struct dirty_block **blocks; // in the order first changed
+  uint n;
+  uint *slots;          // open-addressed, index + 1 into blocks by block
+  uint nslots;
+  uint next_free;       // where the search for a free block resumes
+};
+
+// helper for repair
+// block b as changed so far, or NULL if it is unchanged
+struct dirty_block *find_dirty(struct repair *r, uint b) {
+  uint mask = r->nslots - 1;
+
+  if (r->nslots == 0)
+    return NULL;
+  for (uint h = (b*2654435761u) & mask; r->slots[h] != 0; h = (h + 1) & mask)
+    if (r->blocks[r->slots[h] - 1]->block == b)
+      return r->blocks[r->slots[h] - 1];
+  return NULL;
+}
+
+// helper for repair
+// index blocks[i] by its block number
+void add_slot(struct repair *r, uint i) {
+  uint mask = r->nslots - 1;
+  uint h = (r->blocks[i]->block*2654435761u) & mask;
+
+  while (r->slots[h] != 0)
+    h = (h + 1) & mask;
+  r->slots[h] = i + 1;
+}
+
+// helper for repair
+// block b to be changed, read from the image the first time
+char *repair_block(struct repair *r, uint b) {
+  struct dirty_block *d = find_dirty(r, b);
+  void *p;
+
+  if (d != NULL)
+    return d->data;
+
+  // the table is kept at most half full, and the list grows with it
+  if (2*(r->n + 1) > r->nslots) {
+    r->nslots = r->nslots ? 2*r->nslots : 64;
+    free(r->slots);
+    if (((r->slots = calloc(r->nslots, sizeof(uint))) == NULL) ||
+        ((r->blocks = realloc(r->blocks, (r->nslots / 2)*
+                              sizeof(struct dirty_block *))) == NULL))
+      die();
+    for (uint i = 0; i < r->n; i++)
+      add_slot(r, i);
+  }
+  if ((d = malloc(sizeof(struct dirty_block))) == NULL)
+    die();
+  d->block = b;
+  if ((p = read_block(r->img, b, d->old)) != d->old)
+    memcpy(d->old, p, r->sb->bsize);
+  memcpy(d->data, d->old, r->sb->bsize);
+  r->blocks[r->n] = d;
+  add_slot(r, r->n++);
+  return d->data;
+}
+
+// helper for repair
+// block b as the repair has left it so far
+void *repair_read(struct repair *r, uint b, void *buf) {
+  struct dirty_block *d = find_dirty(r, b);
+  return (d != NULL) ? d->data : read_block(r->img, b, buf);
+}
+
+// helper for repair
+// inode inum, to be changed
+struct dinode *repair_inode(struct repair *r, uint inum) {
+  return (struct dinode *) repair_block(r, IBLOCK(inum, r->sb)) +
+         inum % IPB(r->sb->bsize);
+}
+
+// helper for repair
+// inode inum as the repair has left it so far
+struct dinode inode_now(struct repair *r, uint inum) {
+  union block buf;
+  return ((struct dinode *) repair_read(r, IBLOCK(inum, r->sb), &buf))
+         [inum % IPB(r->sb->bsize)];
+}
+
+// helper for repair
+// address of the k-th data block of node, or 0 for none
+uint block_addr(struct repair *r, struct dinode *node, uint k) {
+  union block buf;
+
+  if (k < NDIRECT)
+    return node->addrs[k];
+  if (node->addrs[NDIRECT] == 0)
+    return 0;
+  return ((uint *) repair_read(r, node->addrs[NDIRECT], &buf))[k - NDIRECT];
+}
+
+// helper for repair
+// a free data block, zeroed and marked in use, or 0 if none is left; blocks
+// are only taken if no inode uses them, whatever the bitmap says
+uint alloc_block(struct repair *r) {
+  uint64_t *used = r->sc->used;
+  uint b;
+
+  for (b = r->next_free; b < r->sb->size; b++)
+    if (!((used[b / 64] >> (b % 64)) & 1))
+      break;
+  if (b >= r->sb->size)
+    return 0;
+  r->next_free = b + 1;
+  SETBIT(used, b);
+  memset(repair_block(r, b), 0, r->sb->bsize);
+  return b;
+}
+
+// helper for repair
+// name inum in directory dir, at the first free entry from its *from-th
+// block on, growing dir by a block when it is full; returns -1 if it cannot
+int dir_add(struct repair *r, uint dir, uint inum, char *name, uint *from) {
+  struct dinode node = inode_now(r, dir);
+  uint bsize = r->sb->bsize;
+  struct dirent *block;
+  union block buf;
+  uint k, b, n;
+
+  for (k = *from; k < MAXFILE(bsize); k++) {
+    if ((b = block_addr(r, &node, k)) == 0)
+      continue;
+    block = repair_read(r, b, &buf);
+    for (n = 0; n < DPB(bsize); n++)
+      if (block[n].inum == 0)
+        goto found;
+  }
+
+  // full, so the first block not in use is added
+  for (k = 0; (k < MAXFILE(bsize)) && (block_addr(r, &node, k) != 0); k++)
+    ;
+  if (k == MAXFILE(bsize))
+    return -1;
+  if ((k >= NDIRECT) && (node.addrs[NDIRECT] == 0)) {
+    if ((b = alloc_block(r)) == 0)
+      return -1;
+    repair_inode(r, dir)->addrs[NDIRECT] = b;
+  }
+  if ((b = alloc_block(r)) == 0)
+    return -1;
+  if (k < NDIRECT)
+    repair_inode(r, dir)->addrs[k] = b;
+  else
+    ((uint *) repair_block(r, inode_now(r, dir).addrs[NDIRECT]))
+      [k - NDIRECT] = b;
+  n = 0;
+
+ found: ;
+  struct dirent *d = (struct dirent *) repair_block(r, b) + n;
+  d->inum = inum;
+  memset(d->name, 0, DIRSIZ); // a name of DIRSIZ bytes has no NUL
+  memcpy(d->name, name, strnlen(name, DIRSIZ));
+  struct dinode *dp = repair_inode(r, dir);
+  if (dp->size < k*bsize + (n + 1)*sizeof(struct dirent))
+    dp->size = k*bsize + (n + 1)*sizeof(struct dirent);
+  *from = k;
+  return 0;
+}
+
+// helper for repair
+// lost_found as named by the root directory, or 0 if it names none; only
+// the entries the directory graph holds for the root are read
+uint find_lost_found(struct repair *r) {
+  struct dir_graph *g = &r->sc->graph;
+  struct dirent *d;
+  union block buf;
+
+  for (uint e = g->row[ROOTINO]; e < g->row[ROOTINO + 1]; e++) {
+    if (g->edge[e].dotdot)
+      continue;
+    d = (struct dirent *) ((char *) repair_read(r, g->edge[e].block, &buf) +
+                           g->edge[e].off);
+    if (strncmp(d->name, "lost_found", DIRSIZ) == 0)
+      return d->inum;
+  }
+  return 0;
+}
+
+// helper for repair
+// point every .. entry of directory inum at parent, found where the
+// directory graph says they are
+void set_dotdot(struct repair *r, uint inum, uint parent) {
+  struct dir_graph *g = &r->sc->graph;
+  struct dir_edge *e;
+
+  for (uint k = g->row[inum]; k < g->row[inum + 1]; k++) {
+    e = &g->edge[k];
+    if (e->dotdot && (e->child != parent))
+      ((struct dirent *) (repair_block(r, e->block) + e->off))->inum = parent;
+  }
+}
+
+// helper for repair, checks #5 and #6
+// blocks in use are marked so, and data blocks in use nowhere marked free
+void repair_bitmap(struct repair *r, uint db1) {
+  struct superblock *sb = r->sb;
+  uint64_t *bm = (uint64_t *) r->sc->bm, *used = r->sc->used;
+  uint64_t w, want, bits, lo, hi, nwords = BITWORDS(sb->size);
+  uint64_t words_per_block = sb->bsize / sizeof(uint64_t);
+  uint64_t *block;
+
+  for (w = 0; w < nwords; w++) {
+    // the bits of this word check #6 looks at, [db1, dataend)
+    lo = (db1 > w*64) ? db1 - w*64 : 0;
+    hi = (sb->dataend > w*64) ? sb->dataend - w*64 : 0;
+    bits = 0;
+    if ((lo < 64) && (hi > lo))
+      bits = ((hi >= 64) ? ~(uint64_t) 0 : ((uint64_t) 1 << hi) - 1) &
+             ~(((uint64_t) 1 << lo) - 1);
+    want = (bm[w] | used[w]) & ~(bits & ~used[w]);
+    if (want == bm[w])
+      continue;
+    block = (uint64_t *) repair_block(r, BBLOCK(w*64, sb));
+    block[w % words_per_block] = want;
+  }
+}
+
+// helper for repair
+// make sure the directory holding path has its entries on disk
+void sync_dir(char *path) {
+  char dir[4096];
+  char *slash;
+  int fd;
+
+  snprintf(dir, sizeof(dir), "%s", path);
+  if ((slash = strrchr(dir, '/')) == NULL)
+    snprintf(dir, sizeof(dir), ".");
+  else
+    slash[(slash == dir) ? 1 : 0] = '\0';
+  if ((fd = open(dir, O_RDONLY)) < 0)
+    die();
+  if ((fsync(fd) < 0) || (close(fd) < 0))
+    die();
+}
+
+// helper for repair
+// running sum of the undo records
+uint64_t undo_sum(uint64_t sum, struct undo_record *rec, uint bsize) {
+  return (sum ^ hash_block(rec->data, bsize) ^ rec->block)*0x100000001b3ULL;
+}
+
+// helper for repair
+// write block b of bsize bytes to the image at fd; a block of zeros is
+// punched out as a hole instead where the file system can, so that a sparse
+// image stays sparse
+void write_block(int fd, void *data, uint bsize, uint b) {
+  if ((memcmp(data, zeros, bsize) == 0) &&
+      (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                 (off_t) b*bsize, bsize) == 0))
+    return;
+  if (pwrite(fd, data, bsize, (off_t) b*bsize) != bsize)
+    die();
+}
+
+// helper for repair
+// play back the undo log at path onto the image at fd, if a repair left one,
+// and remove it; a log that is not whole was cut short before the image was
+// touched, so it is only removed
+void undo_rollback(char *path, int fd) {
+  struct undo_header h;
+  struct undo_record rec;
+  struct stat sbuf;
+  uint64_t sum = 0;
+  size_t rsize;
+  FILE *f;
+  uint i;
+
+  if ((f = fopen(path, "r")) == NULL)
+    return;
+  if ((fstat(fileno(f), &sbuf) == 0) &&
+      (fread(&h, sizeof(h), 1, f) == 1) &&
+      (memcmp(h.magic, UNDO_MAGIC, sizeof(h.magic)) == 0) &&
+      (h.version == UNDO_VERSION) &&
+      ((h.bsize == BSIZE) || (h.bsize == MAXBSIZE)) &&
+      ((uint64_t) sbuf.st_size ==
+       sizeof(h) + (uint64_t) h.nblocks*UNDO_RECORD_SIZE(h.bsize))) {
+    rsize = UNDO_RECORD_SIZE(h.bsize);
+    for (i = 0; (i < h.nblocks) && (fread(&rec, rsize, 1, f) == 1); i++)
+      sum = undo_sum(sum, &rec, h.bsize);
+    if ((i == h.nblocks) && (sum == h.sum) &&
+        (fseek(f, sizeof(h), SEEK_SET) == 0)) {
+      for (i = 0; i < h.nblocks; i++) {
+        if (fread(&rec, rsize, 1, f) != 1)
+          die();
+        write_block(fd, rec.data, h.bsize, rec.block);
+      }
+      if (fsync(fd) < 0)
+        die();
+    }
+  }
+  fclose(f);
+  if (unlink(path) < 0)
+    die();
+  sync_dir(path);
+}
+
+// qsort order of changed blocks, by block number
+int cmp_dirty(const void *a, const void *b) {
+  uint x = (*(struct dirty_block **) a)->block;
+  uint y = (*(struct dirty_block **) b)->block;
+  return (x > y) - (x < y);
+}
+
+// helper for repair
+// keep only the blocks that end up different, in block order
+void repair_changes(struct repair *r) {
+  struct dirty_block *d;
+  uint i, n = 0;
+
+  for (i = 0; i < r->n; i++) {
+    d = r->blocks[i];
+    if (memcmp(d->old, d->data, r->sb->bsize) != 0)
+      r->blocks[n++] = d;
+    else
+      free(d);
+  }
+  r->n = n;
+  for (i = 0; i < r->nslots; i++)
+    r->slots[i] = 0;
+  if (n > 1)
+    qsort(r->blocks, n, sizeof(struct dirty_block *), cmp_dirty);
+  for (i = 0; i < n; i++)
+    add_slot(r, i);
+}
+
+// helper for repair
+// save the blocks repair_changes kept to the undo log at path, then write
+// them to the image at fd
+void repair_commit(struct repair *r, int fd, char *path) {
+  uint bsize = r->sb->bsize;
+  struct undo_header h = { UNDO_MAGIC, UNDO_VERSION, r->n, bsize, 0, 0 };
+  struct undo_record rec;
+  struct dirty_block *d;
+  uint i, n = r->n;
+  FILE *f;
+
+  if (n == 0)
+    return;
+
+  if ((f = fopen(path, "w")) == NULL)
+    die();
+  for (i = 0; i < n; i++) {
+    rec.block = r->blocks[i]->block;
+    memcpy(rec.data, r->blocks[i]->old, bsize);
+    h.sum = undo_sum(h.sum, &rec, bsize);
+  }
+  if (fwrite(&h, sizeof(h), 1, f) != 1)
+    die();
+  for (i = 0; i < n; i++) {
+    rec.block = r->blocks[i]->block;
+    memcpy(rec.data, r->blocks[i]->old, bsize);
+    if (fwrite(&rec, UNDO_RECORD_SIZE(bsize), 1, f) != 1)
+      die();
+  }
+  if ((fflush(f) != 0) || (fsync(fileno(f)) < 0) || (fclose(f) != 0))
+    die();
+  sync_dir(path);
+
+  for (i = 0; i < n; i++) {
+    d = r->blocks[i];
+    // on die the log stays, and the next repair plays it back
+    write_block(fd, d->data, bsize, d->block);
+    r->img->bytes_written += bsize;
+  }
+  if (fsync(fd) < 0)
+    die();
+  if (unlink(path) < 0)
+    die();
+  sync_dir(path);
+}
+
+// patches
+// a repair can save the blocks it changes to a patch, with or without
+// writing them: each with a hash of what it held and all it holds after.
+// The patch then applies to any copy of the image it was made from, and
+// blocks are only written once every block it names is found to hold what
+// the patch expects
+
+#define PATCH_MAGIC "xv6fpat"
+#define PATCH_VERSION 2
+
+struct patch_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t nblocks;     // records that follow
+  uint32_t size;        // of the image, in blocks
+  uint32_t bsize;       // of its blocks
+  uint64_t sum;         // of the records
+};
+
+struct patch_record {
+  uint32_t block;
+  uint32_t unused;
+  uint64_t old_hash;    // hash_block of the block before
+  char data[MAXBSIZE];  // the block after, bsize bytes of it
+};
+
+// bytes a record takes in a patch of bs-byte blocks
+#define PATCH_RECORD_SIZE(bs) (sizeof(struct patch_record) - MAXBSIZE + (bs))
+
+// helper for patches
+// running sum of the patch records
+uint64_t patch_sum(uint64_t sum, struct patch_record *rec, uint bsize) {
+  return (sum ^ hash_block(rec->data, bsize) ^ rec->old_hash ^ rec->block)*
+         0x100000001b3ULL;
+}
+
+// helper for patches
+// the record of a changed block
+void patch_record(struct dirty_block *d, struct patch_record *rec,
+                  uint bsize) {
+  rec->block = d->block;
+  rec->unused = 0;
+  rec->old_hash = hash_block(d->old, bsize);
+  memcpy(rec->data, d->data, bsize);
+}
+
+// save the blocks repair_changes kept to the patch at path
+void write_patch(struct repair *r, char *path) {
+  uint bsize = r->sb->bsize;
+  struct patch_header h = { PATCH_MAGIC, PATCH_VERSION, r->n, r->sb->size,
+                            bsize, 0 };
+  struct patch_record rec;
+  char tmp[4096];
+  FILE *f;
+  uint i;
+
+  for (i = 0; i < r->n; i++) {
+    patch_record(r->blocks[i], &rec, bsize);
+    h.sum = patch_sum(h.sum, &rec, bsize);
+  }
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp))
+    die();
+  if ((f = fopen(tmp, "w")) == NULL)
+    die();
+  if (fwrite(&h, sizeof(h), 1, f) != 1)
+    die();
+  for (i = 0; i < r->n; i++) {
+    patch_record(r->blocks[i], &rec, bsize);
+    if (fwrite(&rec, PATCH_RECORD_SIZE(bsize), 1, f) != 1)
+      die();
+  }
+  if ((fclose(f) != 0) || (rename(tmp, path) != 0))
+    die();
+}
+
+// apply the patch at patch to the image at image, or with dry_run only make
+// sure it applies; blocks already as the patch leaves them are passed over,
+// so a patch applies twice. Returns 1 with the reason in msg if it does not
+// apply, in which case nothing is written
+int apply_patch(char *image, char *patch, int dry_run, char *msg, size_t len) {
+  struct patch_header h;
+  struct patch_record rec;
+  struct stat sbuf;
+  union block buf;
+  uint64_t sum = 0;
+  char undo[4096];
+  size_t rsize;
+  void *cur;
+  FILE *f;
+  uint i;
+  int fd, rc = 1;
+
+  msg[0] = '\0';
+  if ((fd = open(image, dry_run ? O_RDONLY : O_RDWR)) < 0) {
+    snprintf(msg, len, "image not found.\n");
+    return 1;
+  }
+  if ((f = fopen(patch, "r")) == NULL) {
+    snprintf(msg, len, "patch not found.\n");
+    close(fd);
+    return 1;
+  }
+  if (snprintf(undo, sizeof(undo), "%s.undo", image) >= (int) sizeof(undo))
+    die();
+  if (!dry_run)
+    undo_rollback(undo, fd);
+
+  struct image img = { NULL, 0, fd, NULL, 0, 0 };
+  struct superblock sb = { 0 };
+  struct repair r = { &img, &sb, NULL, NULL, 0, NULL, 0, 0 };
+
+  // the patch has to be whole, and made for an image of this size
+  if ((fstat(fileno(f), &sbuf) != 0) || (fread(&h, sizeof(h), 1, f) != 1) ||
+      (memcmp(h.magic, PATCH_MAGIC, sizeof(h.magic)) != 0) ||
+      (h.version != PATCH_VERSION) ||
+      ((h.bsize != BSIZE) && (h.bsize != MAXBSIZE)) ||
+      ((uint64_t) sbuf.st_size !=
+       sizeof(h) + (uint64_t) h.nblocks*PATCH_RECORD_SIZE(h.bsize))) {
+    snprintf(msg, len, "ERROR: bad patch.\n");
+    goto done;
+  }
+  rsize = PATCH_RECORD_SIZE(h.bsize);
+  for (i = 0; (i < h.nblocks) && (fread(&rec, rsize, 1, f) == 1); i++)
+    sum = patch_sum(sum, &rec, h.bsize);
+  if ((i != h.nblocks) || (sum != h.sum)) {
+    snprintf(msg, len, "ERROR: bad patch.\n");
+    goto done;
+  }
+  if (fstat(fd, &sbuf) != 0)
+    die();
+  read_superblock(&img, sbuf.st_size, &sb);
+  img.cache = cache_create(1, sb.bsize);
+  if ((sb.size != h.size) || (sb.bsize != h.bsize)) {
+    snprintf(msg, len, "ERROR: image does not match the patch.\n"
+                       "  the patch is for %u blocks of %u bytes, the image "
+                       "has %u of %u.\n", h.size, h.bsize, sb.size, sb.bsize);
+    goto done;
+  }
+
+  // every block first, then the writes
+  if (fseek(f, sizeof(h), SEEK_SET) != 0)
+    die();
+  for (i = 0; i < h.nblocks; i++) {
+    if (fread(&rec, rsize, 1, f) != 1)
+      die();
+    if (rec.block >= h.size) {
+      snprintf(msg, len, "ERROR: bad patch.\n");
+      goto done;
+    }
+    cur = read_block(&img, rec.block, &buf);
+    if (hash_block(cur, sb.bsize) == rec.old_hash)
+      memcpy(repair_block(&r, rec.block), rec.data, sb.bsize);
+    else if (memcmp(cur, rec.data, sb.bsize) != 0) {
+      snprintf(msg, len, "ERROR: image does not match the patch.\n"
+                         "  block %u differs.\n", rec.block);
+      goto done;
+    }
+  }
+  rc = 0;
+  repair_changes(&r);
+  if (!dry_run)
+    repair_commit(&r, fd, undo);
+
+ done:
+  for (i = 0; i < r.n; i++)
+    free(r.blocks[i]);
+  free(r.blocks);
+  free(r.slots);
+  cache_free(img.cache);
+  fclose(f);
+  if (close(fd) < 0)
+    die();
+  return rc;
+}
+
+// repair the image at fd, whose checks #1-5 have been run into sc with
+// checks #1-4 passing; the undo log is kept at path. With fd -1 nothing is
+// written, and with a patch path the changes are saved there. Returns 1 with
+// the reason in msg if the repair cannot be made, in which case nothing is
+// written
+int repair_image(struct image *img,
+                 struct superblock *sb,
+                 struct scan *sc,
+                 uint db1,
+                 int fd,
+                 char *path,
+                 char *patch,
+                 char *msg,
+                 size_t len) {
+  struct repair r = { img, sb, sc, NULL, 0, NULL, 0, db1 };
+  uint lf, lf_from = 0, from = 0, i;
+  char name[DIRSIZ + 1];
+  int rc = 0;
+
+  // lost_found is looked up, and lost directories relinked, in the graph
+  if (sc->graph.row == NULL) {
+    snprintf(msg, len, "ERROR: no directory graph to repair with.\n");
+    return 1;
+  }
+
+  // check #9, every inode in use but named nowhere goes in lost_found
+  for (i = 2; i < sb->ninodes; i++)
+    if ((inode_infos[i].type != 0) && (sc->refs[i] == 0))
+      break;
+  if (i == sb->ninodes)
+    goto bitmap;
+
+  lf = find_lost_found(&r);
+  if ((lf != 0) && ((lf >= sb->ninodes) || (inode_infos[lf].type != T_DIR))) {
+    snprintf(msg, len, "ERROR: lost_found is not a directory.\n");
+    rc = 1;
+    goto done;
+  }
+  if (lf == 0) { // made the way mkdir makes a directory
+    for (lf = 2; (lf < sb->ninodes) && (lf <= 0xffff); lf++)
+      if ((inode_infos[lf].type == 0) && (sc->refs[lf] == 0))
+        break;
+    if ((lf == sb->ninodes) || (lf > 0xffff)) {
+      snprintf(msg, len, "ERROR: no free inode for lost_found.\n");
+      rc = 1;
+      goto done;
+    }
+    struct dinode *dp = repair_inode(&r, lf);
+    memset(dp, 0, sizeof(struct dinode));
+    dp->type = T_DIR;
+    dp->nlink = 1;
+    inode_infos[lf].type = T_DIR;
+    sc->refs[lf] = 1;
+    if ((dir_add(&r, lf, lf, ".", &lf_from) < 0) ||
+        (dir_add(&r, lf, ROOTINO, "..", &lf_from) < 0) ||
+        (dir_add(&r, ROOTINO, lf, "lost_found", &from) < 0))
+      goto full;
+    repair_inode(&r, ROOTINO)->nlink++;
+  }
+
+  for (i = 2; i < sb->ninodes; i++) {
+    if ((inode_infos[i].type == 0) || (sc->refs[i] != 0))
+      continue;
+    if (i > 0xffff) { // dirents hold 16-bit inode numbers
+      snprintf(msg, len, "ERROR: lost inode %u cannot be named in a "
+                         "directory.\n", i);
+      rc = 1;
+      goto done;
+    }
+    snprintf(name, sizeof(name), "#%u", i);
+    if (dir_add(&r, lf, i, name, &lf_from) < 0)
+      goto full;
+    if (inode_infos[i].type == T_DIR) {
+      set_dotdot(&r, i, lf);
+      repair_inode(&r, lf)->nlink++;
+    } else {
+      repair_inode(&r, i)->nlink = 1; // its only name now
+    }
+  }
+
+ bitmap:
+  repair_bitmap(&r, db1);
+  repair_changes(&r);
+  if (patch != NULL)
+    write_patch(&r, patch);
+  if (fd >= 0)
+    repair_commit(&r, fd, path);
+  goto done;
+
+ full:
+  snprintf(msg, len, "ERROR: no room left in lost_found.\n");
+  rc = 1;
+
+ done:
+  for (i = 0; i < r.n; i++)
+    free(r.blocks[i]);
+  free(r.blocks);
+  free(r.slots);
+  return rc;
+}
+
+// cache used when streaming an image without --cache-mb
+#define DEFAULT_CACHE_MB 64
+
+// violations kept by --all without --max-errors
+#define DEFAULT_MAX_ERRORS 10000
+
+// what each image is checked for
+struct options {
+  int nthreads;
+  int cache_mb;
+  int report_all;
+  int max_errors;
+  int stats;
+  char *summary;
+  int repair;
+  int dry_run;       // of a repair, or of --apply-patch
+  char *patch;
+  int readahead;     // plan_readahead before the scan
+  int populate;      // read the whole mapping in, on huge pages if it can
+  int io_depth;      // reads in flight per scan thread when streaming
+  int tier;          // TIER_*, the checks run
+  int stop_after;    // violations --all stops at, or 0
+  size_t memory_limit; // scratch space the checks may take, or 0 for any
+  size_t part_bytes; // scratch space for each pass of checks #7-12 when
+                     // memory_limit is too small to hold them at once, or 0
+  int verbose;       // print the line below the error, if there is one
+};
+
+// check #0
+// the superblock must describe an image the other checks can walk: the
+// inode table and bitmap end before the last block, and the last block is
+// inside the image when its length len is known
+int check_superblock(struct superblock *sb, uint64_t len) {
+  uint64_t db1 = (uint64_t) sb->bmapstart + sb->size / BPB(sb->bsize) + 1;
+
+  if ((sb->size == 0) || (db1 > sb->size) || (sb->dataend > sb->size))
+    return -1;
+  // the log, inode table and bitmap come in that order
+  if (((uint64_t) sb->logstart + sb->nlog > sb->inodestart) ||
+      ((uint64_t) sb->inodestart + sb->ninodes / IPB(sb->bsize) + 1 >
+       sb->bmapstart))
+    return -1;
+  if ((len > 0) && ((uint64_t) sb->size*sb->bsize > len))
+    return -1;
+  return 0;
+}
+
+// the most scratch space checking an image as o asks can hold at once,
+// counted allocation by allocation as the checks make them
+size_t scratch_size(struct superblock *sb, struct options *o, int streamed) {
+  uint nused = (sb->size > sb->dataend) ? sb->size : sb->dataend;
+  size_t nthreads = o->nthreads;
+  size_t niblocks = (sb->ninodes + IPB(sb->bsize) - 1) / IPB(sb->bsize);
+  size_t nnodes = sb->ninodes;
+  size_t bm_blocks = (BITWORDS(nused)*sizeof(uint64_t) + sb->bsize - 1) /
+                     sb->bsize;
+  size_t words = ARENA_ROUND(BITWORDS(nused)*sizeof(uint64_t));
+  size_t refs = ARENA_ROUND((size_t) sb->ninodes*sizeof(int));
+  size_t owners = ARENA_ROUND((size_t) sb->size*sizeof(struct block_owner));
+  size_t graph = ARENA_ROUND(((size_t) sb->ninodes + 1)*sizeof(uint));
+  size_t win = streamed ? ARENA_ROUND(IWINDOW*sb->bsize) : 0;
+  size_t ninodes_win = IWINDOW*IPB(sb->bsize), fetch = 0;
+  size_t report = ARENA_ROUND(((size_t) o->max_errors + 1)*
+                              sizeof(struct violation));
+  size_t walk, loops, kept, scan, passes, update, most, plan;
+
+  // held throughout: the bitmap when streaming, and the inode summaries
+  size_t base = (streamed ? ARENA_ROUND(bm_blocks*sb->bsize) : 0) +
+                ARENA_ROUND((size_t) sb->ninodes*sizeof(struct inode_info));
+
+  // extra check #2, the .. graph and then a walk in place of its queue
+  walk = ARENA_ROUND(nnodes) + 2*ARENA_ROUND(nnodes*sizeof(uint));
+  if (walk < ARENA_ROUND(nnodes*sizeof(uint)) +
+             2*ARENA_ROUND((nnodes + 1)*sizeof(uint)))
+    walk = ARENA_ROUND(nnodes*sizeof(uint)) +
+           2*ARENA_ROUND((nnodes + 1)*sizeof(uint));
+  loops = 2*ARENA_ROUND(nnodes*sizeof(uint)) + ARENA_ROUND(nnodes) + walk;
+
+  // read-ahead, over before anything else is taken
+  plan = 0;
+  if (o->readahead && (o->summary == NULL))
+    plan = 2*ARENA_ROUND(BITWORDS(sb->size)*sizeof(uint64_t)) + win;
+
+  if (o->report_all) {
+    most = report + words + owners + refs + graph + loops;
+    return base + ((plan > most) ? plan : most);
+  }
+
+  // what the scan keeps for checks #5-12, and what it uses on the way
+  if (streamed && (o->io_depth > 0))
+    fetch = ARENA_ROUND(o->io_depth*sizeof(struct fetch_slot)) +
+            ARENA_ROUND((size_t) o->io_depth*sb->bsize) +
+            ARENA_ROUND(ninodes_win*(NDIRECT + 1)*sizeof(uint)) +
+            ARENA_ROUND(FETCH_THREADS*sizeof(pthread_t)) +
+            ARENA_ROUND(ninodes_win*sizeof(uint64_t));
+  kept = 2*words + refs + owners + graph;
+  scan = ARENA_ROUND(nthreads*sizeof(struct worker)) +
+         ARENA_ROUND(niblocks*sizeof(ushort)) +
+         (nthreads - 1)*(2*words + refs) + nthreads*(win + fetch) +
+         ARENA_ROUND(nthreads*sizeof(uint));
+  // with --memory-limit only the bitmaps are kept, checks #7-12 taking
+  // part_bytes at a time once the scan is done
+  passes = 0;
+  if (o->part_bytes != 0) {
+    kept = 2*words;
+    scan -= (nthreads - 1)*refs;
+    passes = ARENA_ROUND(o->part_bytes);
+  }
+  most = (scan > loops) ? scan : loops;
+  most = kept + ((passes > most) ? passes : most);
+
+  // bringing a summary up to date comes before anything is kept
+  if (o->summary != NULL) {
+    update = ARENA_ROUND(niblocks + 1) +
+             ARENA_ROUND(nthreads*sizeof(struct hash_job)) + nthreads*win +
+             2*words + owners + refs;
+    if (update > most)
+      most = update;
+  }
+  if (plan > most)
+    most = plan;
+  return base + most;
+}
+
+// one check of an image: check_image sets it up from a file, and
+// xv6fsck_check from a buffer in memory
+struct check {
+  struct options *o;
+  struct image img;
+  uint64_t img_len;      // 0 when not known
+  int cache_mb;          // img is streamed through a cache this large
+  int wfd;               // a repair writes through this
+  char *undo;            // and keeps its undo log here
+  struct stats st;
+  struct superblock sb;
+  struct scan sc;
+  int err;               // the first failed check, or OK
+  char detail[256];      // printed below the error, if any
+  void (*report)(struct report *rep, void *arg); // the --all report
+  void *arg;
+};
+
+// the check scheduler
+// once the scan is done, checks #6-12 and the extra checks only read what it
+// recorded, so each stage of them is a node that waits only for the nodes
+// whose records it needs, and with -j the nodes ready to run are run on up to
+// that many threads at once. The nodes are numbered in the order the checks
+// have always been made: once a node fails, those after it are told to stop,
+// and the failure reported is that of the first node to fail in that order,
+// which is only known once every node before it has passed
+
+#define NODE_WAITING 0
+#define NODE_RUNNING 1
+#define NODE_DONE    2
+
+#define MAX_NODES 4
+
+struct check_node {
+  char *stage;           // the --stats stage it is
+  int (*run)(struct check *c, struct check_node *n);
+  uint deps;             // bit i set: waits for node i to pass
+  int scratch;           // takes the scratch arena while it runs
+  int state;
+  int stop;              // a node before it failed, so it need not finish
+  int err;               // OK, or the check it failed
+  char detail[256];      // printed below the error, if any
+  struct stats st;       // its stage, when stats are on
+};
+
+struct scheduler {
+  struct check *c;
+  struct check_node node[MAX_NODES];
+  int n;
+  int failed;            // the first node to fail so far, or n
+  int running;
+  int scratch_held;
+  struct arena lent;     // the rest of the arena, for the node holding it
+  struct inode_info *infos;
+  int recover;           // whether a node can bail, rather than exit, on die
+  int died;              // some node gave up
+  pthread_mutex_t lock;
+  pthread_cond_t changed; // a node started or finished
+};
+
+// check #6, and checks #7 and #8
+int node_blocks(struct check *c, struct check_node *n) {
+  struct scan *sc = &c->sc;
+
+  // check #6
+  // for blocks marked in-use in bitmap, actually is in-use somewhere
+  if (sc->bits.leaked > 0) {
+    snprintf(n->detail, sizeof(n->detail),
+             "  %lu blocks not in use, the first is block %lu.\n",
+             (unsigned long) sc->bits.leaked,
+             (unsigned long) sc->bits.first_leaked);
+    return BITMAP_UNUSED;
+  }
+  if (c->o->tier == TIER_QUICK) // the last of its checks
+    return OK;
+
+  if (sc->partitioned)
+    find_dups_partitioned(&c->img, &c->sb, sc,
+                          c->o->part_bytes / sizeof(struct block_owner));
+
+  // check #7
+  // for in-use inodes, direct address in use is only used once
+  if (sc->direct_dup.found) {
+    describe_dup(n->detail, sizeof(n->detail), &sc->direct_dup);
+    return DIRECT_REUSED;
+  }
+
+  // check #8
+  // for in-use inodes, indirect address in use is only used once
+  if (sc->indirect_dup.found) {
+    describe_dup(n->detail, sizeof(n->detail), &sc->indirect_dup);
+    return INDIRECT_REUSED;
+  }
+  return OK;
+}
+
+// checks #9-12
+int node_refs(struct check *c, struct check_node *n) {
+  struct superblock *sb = &c->sb;
+  struct scan *sc = &c->sc;
+  int err = OK;
+
+  // the inodes [lo, hi) at a time, all at once unless partitioned
+  size_t pass = arena_mark();
+  uint i, lo, hi, part_inodes = c->o->part_bytes / sizeof(int);
+  int *refs = sc->refs, nrefs = 0;
+  for (lo = 0; lo < sb->ninodes; lo = hi) {
+    hi = sb->ninodes;
+    if (sc->partitioned) {
+      if (sb->ninodes - lo > part_inodes)
+        hi = lo + part_inodes;
+      arena_release(pass);
+      refs = arena_alloc((size_t) (hi - lo)*sizeof(int));
+      refs_in_range(&c->img, sb, sc, lo, hi, refs);
+    }
+
+    for (i = (lo > 2) ? lo : 2; i < hi; i++) {
+      struct inode_info *info = &inode_infos[i];
+      nrefs = refs[i - lo];
+      if ((i % 4096 == 0) && stopped())
+        goto done;
+
+      // check #9
+      // inode marked in use must be referred to in at least one directory
+      if ((info->type != 0) && (nrefs == 0)) {
+        err = NOT_IN_DIR;
+        goto done;
+      }
+
+      // check #10
+      // all inodes referred to in valid director are actually in use
+      if ((nrefs != 0) && (info->type == 0)) {
+        err = REF_FREE;
+        goto names;
+      }
+      // check #11
+      // reference counts for regular files match number of times
+      // file is referred to in directories
+      if ((info->type == T_FILE) && (info->nlink != nrefs)) {
+        err = BAD_REFCOUNT;
+        goto names;
+      }
+      // check #12
+      // each directory only appears in one other directory
+      if ((info->type == T_DIR) && (nrefs > 1)) {
+        err = DIR_REPEATED;
+        goto names;
+      }
+    }
+  }
+  goto done;
+
+ names: ; // checks #10-12 name inode i by its path
+  describe_names(&c->img, sb, sc, err, i, nrefs, n->detail,
+                 sizeof(n->detail));
+ done: ;
+  arena_release(pass);
+  return err;
+}
+
+// extra check #1
+// each .. entry in directory points to proper parent inode
+// and parent inode points back to it
+int node_parent(struct check *c, struct check_node *n) {
+  if (check_parent_dir(&c->img, &c->sb, &c->sc.graph, n->detail,
+                       sizeof(n->detail)) < 0)
+    return BAD_PARENT;
+  return OK;
+}
+
+// extra check #2
+// no loops in directory tree
+int node_loops(struct check *c, struct check_node *n) {
+  if (check_no_loops(&c->img, &c->sb, &c->sc, n->detail, sizeof(n->detail),
+                     NULL) < 0)
+    return UNREACHABLE_DIR;
+  return OK;
+}
+
+// the nodes the tier asks for. Checks #9-12 and extra check #1 only read the
+// records of the scan; with --memory-limit they take the place of the
+// ownership map and reference counts, so the nodes that take passes over
+// the image share the arena one at a time, and extra check #1 waits for the
+// passes of checks #9-12 to note the parent of each inode
+void plan_nodes(struct scheduler *s) {
+  struct check *c = s->c;
+  int parted = c->sc.partitioned;
+
+  s->node[0] = (struct check_node) { "checks_6_8", node_blocks, 0, parted };
+  s->node[1] = (struct check_node) { "checks_9_12", node_refs, 0, parted };
+  s->node[2] = (struct check_node) { "E1", node_parent,
+                                     parted ? (1 << 1) : 0, 0 };
+  s->node[3] = (struct check_node) { "E2", node_loops, 0, 1 };
+  s->n = (c->o->tier == TIER_QUICK) ? 1 :
+         (c->o->tier == TIER_STANDARD) ? 2 : 4;
+}
+
+// the first node in order that can start: waiting, before any that failed,
+// with every node it waits for passed, and the arena free if it takes it;
+// -1 if there is none
+int next_node(struct scheduler *s) {
+  struct check_node *n;
+  int i, k;
+
+  if (s->died)
+    return -1;
+  for (i = 0; i < s->failed; i++) {
+    n = &s->node[i];
+    if ((n->state != NODE_WAITING) || (n->scratch && s->scratch_held))
+      continue;
+    for (k = 0; k < i; k++)
+      if ((n->deps & (1u << k)) &&
+          ((s->node[k].state != NODE_DONE) || (s->node[k].err != OK)))
+        break;
+    if (k == i)
+      return i;
+  }
+  return -1;
+}
+
+// run nodes as they become ready, until none is running and none can start
+void run_nodes(struct scheduler *s) {
+  struct arena own = scratch;
+  struct check_node *n;
+  int i;
+
+  pthread_mutex_lock(&s->lock);
+  for (;;) {
+    if ((i = next_node(s)) < 0) {
+      if (s->running == 0)
+        break;
+      pthread_cond_wait(&s->changed, &s->lock);
+      continue;
+    }
+    n = &s->node[i];
+    n->state = NODE_RUNNING;
+    s->running++;
+    if (n->scratch) {
+      s->scratch_held = 1;
+      scratch = s->lent;
+    }
+    node_stop = &n->stop;
+    pthread_mutex_unlock(&s->lock);
+
+    stage_begin(&n->st, n->stage, &s->c->img, &s->c->sc);
+    n->err = n->run(s->c, n);
+    stage_end(&n->st, &s->c->img, &s->c->sc);
+
+    pthread_mutex_lock(&s->lock);
+    node_stop = NULL;
+    if (n->scratch) {
+      s->lent = scratch;
+      scratch = own;
+      s->scratch_held = 0;
+    }
+    n->state = NODE_DONE;
+    s->running--;
+    if ((n->err != OK) && (i < s->failed)) {
+      s->failed = i;
+      for (int k = i + 1; k < s->n; k++)
+        __atomic_store_n(&s->node[k].stop, 1, __ATOMIC_RELAXED);
+    }
+    pthread_cond_broadcast(&s->changed);
+  }
+  pthread_cond_broadcast(&s->changed);
+  pthread_mutex_unlock(&s->lock);
+}
+
+// a thread of run_checks, with the inode_infos of the thread that started
+// it; a node that gives up stops every other node, and leaves run_checks to
+// give up
+void *node_thread(void *arg) {
+  struct scheduler *s = arg;
+  struct arena own = scratch;
+  jmp_buf *outer = bail, here;
+
+  inode_infos = s->infos;
+  if (s->recover) {
+    if (setjmp(here) != 0) {
+      scratch = own;
+      node_stop = NULL;
+      pthread_mutex_lock(&s->lock);
+      s->died = 1;
+      s->running--;
+      for (int k = 0; k < s->n; k++)
+        __atomic_store_n(&s->node[k].stop, 1, __ATOMIC_RELAXED);
+      pthread_cond_broadcast(&s->changed);
+      pthread_mutex_unlock(&s->lock);
+      bail = outer;
+      return NULL;
+    }
+    bail = &here;
+  }
+  run_nodes(s);
+  bail = outer;
+  return NULL;
+}
+
+// checks #6-12 and the extra checks, as far as the tier goes, on the thread
+// that calls it and up to -j - 1 more; the error, if any, is returned with
+// its detail in c->detail
+int run_checks(struct check *c) {
+  struct scheduler s = { c };
+  pthread_t tids[MAX_NODES];
+  int i, started = 0, nthreads;
+
+  plan_nodes(&s);
+  s.failed = s.n;
+  s.infos = inode_infos;
+  s.recover = (bail != NULL);
+  nthreads = (c->o->nthreads < s.n) ? c->o->nthreads : s.n;
+  for (i = 0; i < s.n; i++) {
+    s.node[i].st.on = c->st.on;
+    s.node[i].st.overlap = (nthreads > 1);
+  }
+
+  // the arena past what the scan kept, handed from node to node
+  s.lent = (struct arena) { scratch.base + scratch.used,
+                            scratch.size - scratch.used,
+                            scratch.size - scratch.used, 0,
+                            (scratch.dirty > scratch.used) ?
+                            scratch.dirty - scratch.used : 0, 0 };
+  pthread_mutex_init(&s.lock, NULL);
+  pthread_cond_init(&s.changed, NULL);
+  for (; started < nthreads - 1; started++)
+    if (pthread_create(&tids[started], NULL, node_thread, &s) != 0)
+      break;
+  node_thread(&s);
+  for (i = 0; i < started; i++)
+    pthread_join(tids[i], NULL);
+  pthread_mutex_destroy(&s.lock);
+  pthread_cond_destroy(&s.changed);
+  if (scratch.used + s.lent.dirty > scratch.dirty)
+    scratch.dirty = scratch.used + s.lent.dirty;
+  if (scratch.used + s.lent.peak > scratch.peak)
+    scratch.peak = scratch.used + s.lent.peak;
+  if (s.died)
+    die();
+
+  // each node's stage, in the order of the nodes
+  for (i = 0; i < s.n; i++)
+    if ((s.node[i].st.n > 0) && (c->st.n < MAX_STAGES))
+      c->st.stages[c->st.n++] = s.node[i].st.stages[0];
+
+  if (s.failed == s.n)
+    return OK;
+  memcpy(c->detail, s.node[s.failed].detail, sizeof(c->detail));
+  return s.node[s.failed].err;
+}
+
+// check the image c has opened, from the superblock on; the error, if any, is
+// left in msg and 1 is returned
+int check_loaded(struct check *c, char *msg, size_t len) {
+  struct options *o = c->o;
+  struct image *img = &c->img;
+  struct superblock *sb = &c->sb;
+  struct scan *sc = &c->sc;
+  struct stats *st = &c->st;
+  uint64_t img_len = c->img_len;
+
+  // the layout, and with it the block size, comes from the superblock
+  read_superblock(img, img_len, sb);
+  if (c->cache_mb != 0) {
+    img->cache = cache_create(c->cache_mb, sb->bsize);
+    img->io_depth = o->io_depth;
+  }
+  uint db1 = BBLOCK(sb->size, sb) + 1;
+  char *detail = c->detail;
+  char *bm_buf = NULL;
+  int err, failed = 0;
+
+  sc->tier = o->tier;
+
+  // check #0
+  // nothing is sized from a superblock that does not fit the image
+  if (check_superblock(sb, img_len) < 0) {
+    err = BAD_SUPERBLOCK;
+    snprintf(detail, sizeof(c->detail),
+             "  size %u, data blocks %u, inodes %u in an image of %lu "
+             "bytes.\n", sb->size, sb->nblocks, sb->ninodes,
+             (unsigned long) img_len);
+    if (!o->report_all)
+      goto report;
+    struct violation v; // the only one there is to report
+    struct report bad = { &v, 0, (o->max_errors > 0), 0, o->stop_after };
+    report_add(&bad, BAD_SUPERBLOCK, NONE, 1, -1, NONE);
+    c->report(&bad, c->arg);
+    c->err = err;
+    failed = 1;
+    goto clean_and_exit;
+  }
+  // with --memory-limit too small for every record at once, checks #7-12
+  // take passes of the most scratch space that still fits
+  o->part_bytes = 0;
+  if ((o->memory_limit != 0) &&
+      (scratch_size(sb, o, img->mem == NULL) > o->memory_limit)) {
+    size_t least = sizeof(struct block_owner), most;
+    most = (size_t) sb->size*sizeof(struct block_owner);
+    if (most < (size_t) sb->ninodes*sizeof(int))
+      most = (size_t) sb->ninodes*sizeof(int);
+    o->part_bytes = least;
+    if (scratch_size(sb, o, img->mem == NULL) > o->memory_limit) {
+      snprintf(msg, len, "ERROR: the checks need more than the %lu MB "
+                         "of memory given.\n",
+               (unsigned long) (o->memory_limit >> 20));
+      failed = 1;
+      goto clean_and_exit;
+    }
+    while (least < most) { // the largest that fits
+      o->part_bytes = least + (most - least + 1) / 2;
+      if (scratch_size(sb, o, img->mem == NULL) > o->memory_limit)
+        most = o->part_bytes - 1;
+      else
+        least = o->part_bytes;
+    }
+    o->part_bytes = least;
+    sc->partitioned = 1;
+  }
+  arena_init(scratch_size(sb, o, img->mem == NULL));
+  st->scratch = scratch.size;
+  // the most the checks can take is known before any of them starts
+  if (st->on) {
+    printf("{\"scratch_bytes\":%lu}\n", (unsigned long) st->scratch);
+    fflush(stdout);
+  }
+
+  // the bitmap is read whole, a word past the last block check #6 looks at
+  uint nused = (sb->size > sb->dataend) ? sb->size : sb->dataend;
+  uint bm_blocks = (BITWORDS(nused)*sizeof(uint64_t) + sb->bsize - 1) /
+                   sb->bsize;
+  if (img->mem == NULL)
+    bm_buf = arena_alloc(bm_blocks*sb->bsize);
+  sc->bm = read_blocks(img, sb->bmapstart, bm_blocks, bm_buf);
+
+  inode_infos = arena_alloc(sb->ninodes*sizeof(struct inode_info));
+
+  stage_end(st, img, sc);
+
+  // a summary only reads what changed, so reading ahead would undo it
+  if (o->readahead && (o->summary == NULL)) {
+    stage_begin(st, "readahead", img, sc);
+    plan_readahead(img, sb);
+    stage_end(st, img, sc);
+  }
+
+  if (o->report_all) {
+    struct report all = { NULL, 0, o->max_errors, 0, o->stop_after, img, sb,
+                          &sc->graph };
+    all.v = arena_alloc(((size_t) o->max_errors + 1)*
+                        sizeof(struct violation));
+    stage_begin(st, "all", img, sc);
+    failed = (collect_all(img, sb, sc, db1, &all) > 0);
+    stage_end(st, img, sc);
+    c->err = (all.n > 0) ? all.v[0].err : OK;
+    c->report(&all, c->arg);
+    goto clean_and_exit;
+  }
+
+  // checks #1-5, and everything the remaining checks need
+  err = -1;
+  if (o->summary != NULL) {
+    stage_begin(st, "summary", img, sc);
+    err = check_incremental(img, sb, o->nthreads, sc, o->summary, db1);
+    stage_end(st, img, sc);
+  }
+  if (err < 0) {
+    stage_begin(st, "checks_1_5", img, sc);
+    err = scan_inodes(img, sb, o->nthreads, sc, db1);
+    stage_end(st, img, sc);
+  }
+
+  // lost inodes and the bitmap are only repaired once checks #1-4 pass, for
+  // every inode: check #5 may fail on one before another fails check #1
+  if (o->repair) {
+    if (!sc->checks_1_4_ok) {
+      snprintf(detail, sizeof(c->detail), "  the image was not repaired.\n");
+      goto report;
+    }
+    stage_begin(st, "repair", img, sc);
+    failed = repair_image(img, sb, sc, db1, c->wfd, c->undo, o->patch, msg,
+                          len);
+    stage_end(st, img, sc);
+    goto clean_and_exit;
+  }
+
+  if (err == BITMAP_FREE)
+    snprintf(detail, sizeof(c->detail), "  block %u used by inode %u.\n",
+             sc->bad_block, sc->bad_inum);
+  if (err != OK)
+    goto report;
+
+  // checks #6-12 and the extra checks, as far as the tier goes
+  if ((err = run_checks(c)) != OK)
+    goto report;
+  goto clean_and_exit;
+
+ report: ;
+  stage_end(st, img, sc); // the stage that failed
+  // the line below the error is only asked for, but a repair always says
+  // it was not made
+  snprintf(msg, len, "%s%s", errors[err],
+           (o->verbose || o->repair) ? detail : "");
+  c->err = err;
+  failed = 1;
+
+ clean_and_exit: ;
+  st->scratch_peak = scratch.peak;
+  if (st->on)
+    stats_write(stdout, st);
+  free(sc->dotdots);
+  sc->dotdots = NULL;
+  free(sc->found);
+  free(sc->graph.edge);
+  free(sc->graph.namer);
+  sc->found = NULL;
+  sc->graph = (struct dir_graph) { 0 };
+  inode_infos = NULL; // the arena is kept for the next image
+  return failed;
+}
+
+// the --all report of check_image
+void report_stdout(struct report *rep, void *arg) {
+  report_write(stdout, rep);
+}
+
+// check one image as asked by o; the error, if any, is left in msg and 1 is
+// returned
+int check_image(char *image, struct options *o, char *msg, size_t len) {
+  struct check c = { 0 };
+  struct stat sbuf;
+  void *img_ptr;
+  char undo[4096];
+  int rc;
+
+  c.o = o;
+  c.cache_mb = o->cache_mb;
+  c.wfd = -1;
+  c.undo = undo;
+  c.report = report_stdout;
+  c.st.on = o->stats;
+  msg[0] = '\0';
+  int fd = open(image, (o->repair && !o->dry_run) ? O_RDWR : O_RDONLY);
+  if (fd < 0) {
+    snprintf(msg, len, "image not found.\n");
+    return 1;
+  }
+
+  // a repair writes through a descriptor of its own and reads the image like
+  // any check; one that did not finish is undone first, and a dry run cannot
+  // tell what the image held before it
+  if (o->repair) {
+    if (snprintf(undo, sizeof(undo), "%s.undo", image) >= (int) sizeof(undo))
+      die();
+    if (o->dry_run && (access(undo, F_OK) == 0)) {
+      snprintf(msg, len, "ERROR: %s is left by a repair that did not "
+                         "finish.\n", undo);
+      close(fd);
+      return 1;
+    }
+    if (!o->dry_run) {
+      if ((c.wfd = dup(fd)) < 0)
+        die();
+      undo_rollback(undo, c.wfd);
+    }
+  }
 
   rc = fstat(fd, &sbuf);
   if (rc != 0)
+    die();
+
+  // block devices report no size and cannot be mapped this way, so they are
+  // always streamed, as is any image when a cache size is given
+  c.img = (struct image) { NULL, 0, fd, NULL, 0, 0 };
+  stage_begin(&c.st, "load", &c.img, NULL);
+  c.img_len = sbuf.st_size;
+  if (S_ISREG(sbuf.st_mode))
+    find_extents(&c.img, fd, sbuf.st_size);
+  if ((c.cache_mb == 0) && (sbuf.st_size == 0)) {
+    c.cache_mb = DEFAULT_CACHE_MB;
+    off_t end = lseek(fd, 0, SEEK_END); // the size of a block device
+    c.img_len = (end > 0) ? end : 0;
+  }
+
+  if (c.cache_mb == 0) {
+    img_ptr = mmap(NULL, sbuf.st_size, PROT_READ,
+                   MAP_PRIVATE | (o->populate ? MAP_POPULATE : 0), fd, 0);
+    if (img_ptr == MAP_FAILED)
+      die();
+    // fewer TLB misses where the kernel keeps files on huge pages; a hint
+    if (o->populate)
+      madvise(img_ptr, sbuf.st_size, MADV_HUGEPAGE);
+    if (close(fd) < 0)
+      die();
+    c.img.mem = img_ptr;
+    c.img.len = sbuf.st_size;
+    c.img.fd = -1;
+  }
+
+  rc = check_loaded(&c, msg, len);
+
+  if ((c.wfd >= 0) && (close(c.wfd) < 0))
+    die();
+  if (c.img.mem != NULL) {
+    if (munmap(c.img.mem, c.img.len) < 0)
+      die();
+  } else {
+    cache_free(c.img.cache);
+    if (close(c.img.fd) < 0)
+      die();
+  }
+  free(c.img.extents);
+
+  return rc;
+}
+
+// library
+// xv6fsck_check, declared in xv6fsck.h, checks an image in memory the way
+// check_image checks a mapped one. Whatever would make the checker exit
+// instead returns to it through bail, which frees what the check held
+
+// where the violations of xv6fsck_check go, and how many there were
+struct library_report {
+  const struct xv6fsck_options *opts;
+  uint64_t total;
+};
+
+// the --all report of xv6fsck_check, passed on one violation at a time
+void report_call(struct report *rep, void *arg) {
+  struct library_report *lib = arg;
+  struct xv6fsck_violation out;
+  char path[PATH_DEPTH*(DIRSIZ + 1) + 1];
+  char error[128];
+
+  lib->total = rep->total;
+  if (lib->opts->violation == NULL)
+    return;
+  for (uint i = 0; i < rep->n; i++) {
+    struct violation *v = &rep->v[i];
+    char *msg = errors[v->err] + strlen("ERROR: ");
+
+    out.check = check_ids[v->err];
+    snprintf(error, sizeof(error), "%.*s", (int) strlen(msg) - 1, msg);
+    out.error = error; // as the "error" of --all
+    out.inode = (v->inum != NONE) ? (int64_t) v->inum : -1;
+    out.block = (v->block != NONE) ? (int64_t) v->block : -1;
+    out.offset = v->offset;
+    out.other = (v->other != NONE) ? (int64_t) v->other : -1;
+    out.path = (violation_path(rep, v, path, sizeof(path)) == 0) ? path : NULL;
+    lib->opts->violation(&out, lib->opts->arg);
+  }
+}
+
+int xv6fsck_check(const void *image,
+                  size_t len,
+                  const struct xv6fsck_options *opts,
+                  struct xv6fsck_result *result) {
+  struct xv6fsck_options defaults = { 0 };
+  struct options o = { 0 };
+  struct library_report lib;
+  jmp_buf *outer = bail, here;
+  struct check *c;
+  char msg[512] = "";
+  int rc;
+
+  if (opts == NULL)
+    opts = &defaults;
+  if ((image == NULL) || (len == 0))
+    return -1;
+  o.nthreads = (opts->nthreads > 1024) ? 1024 : opts->nthreads;
+  if (o.nthreads < 1)
+    o.nthreads = 1;
+  o.report_all = opts->report_all;
+  o.tier = opts->tier;
+  if ((o.tier < TIER_THOROUGH) || (o.tier > TIER_QUICK))
+    return -1;
+  o.stop_after = (opts->stop_after > 0) ? opts->stop_after : 0;
+  o.verbose = opts->verbose;
+  o.max_errors = (opts->max_errors < 0) ? 0 : opts->max_errors;
+  if (opts->max_errors == 0)
+    o.max_errors = DEFAULT_MAX_ERRORS;
+  lib = (struct library_report) { opts, 0 };
+  if ((c = calloc(1, sizeof(struct check))) == NULL)
+    return -1;
+
+  // the image is only read, as a mapping with PROT_READ is
+  c->o = &o;
+  c->img = (struct image) { (char *) image, len, -1, NULL, 0, 0 };
+  c->img_len = len;
+  c->wfd = -1;
+  c->report = report_call;
+  c->arg = &lib;
+
+  if (setjmp(here) != 0) {
+    bail = outer;
+    free(c->sc.dotdots);
+    free(c->sc.found);
+    free(c->sc.graph.edge);
+    free(c->sc.graph.namer);
+    if (scratch.base != NULL)
+      arena_free();
+    inode_infos = NULL;
+    free(c);
+    return -1;
+  }
+  bail = &here;
+  stage_begin(&c->st, "load", &c->img, NULL);
+  rc = check_loaded(c, msg, sizeof(msg));
+  bail = outer;
+  if (scratch.base != NULL) // the caller's threads may never check another
+    arena_free();
+
+  if (result != NULL) {
+    result->failed = rc;
+    result->check = check_ids[c->err];
+    snprintf(result->message, sizeof(result->message), "%s", msg);
+    result->violations = lib.total;
+  }
+  free(c);
+  return rc;
+}
+
+// batch mode
+// images are checked by a pool of worker processes, forked once and handed
+// one image at a time, so each image costs neither an exec nor a fresh heap.
+// Workers are processes rather than threads since the checker exits on
+// failures it cannot recover from; an image that makes its worker exit or
+// crash costs only that worker, which is replaced
+
+// the verdict on one image, sent back by a worker
+struct verdict {
+  uint index;      // of the image in the list
+  int rc;
+  char msg[248];   // first line of the error
+};
+
+struct batch_worker {
+  pid_t pid;
+  int task_fd;     // indices of images to check, to the worker
+  int result_fd;   // verdicts, from the worker
+  int busy;
+  uint index;      // image being checked
+};
+
+// the image paths in list, one per line, or on stdin for -
+char **read_list(char *list, uint *n) {
+  FILE *f = (strcmp(list, "-") == 0) ? stdin : fopen(list, "r");
+  char **paths = NULL, *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  uint npaths = 0;
+
+  if (f == NULL) {
+    fprintf(stderr, "image list not found.\n");
+    exit(1);
+  }
+  while ((len = getline(&line, &cap, f)) >= 0) {
+    while ((len > 0) && ((line[len - 1] == '\n') || (line[len - 1] == '\r')))
+      line[--len] = '\0';
+    if (len == 0) // blank line, skip
+      continue;
+    if ((npaths % 1024 == 0) &&
+        ((paths = realloc(paths, (npaths + 1024)*sizeof(char *))) == NULL))
+      exit(1);
+    if ((paths[npaths++] = strdup(line)) == NULL)
+      exit(1);
+  }
+  free(line);
+  if (f != stdin)
+    fclose(f);
+  *n = npaths;
+  return paths;
+}
+
+// read exactly len bytes, or fail if the other end closes first
+int read_full(int fd, void *buf, size_t len) {
+  ssize_t r;
+
+  for (size_t off = 0; off < len; off += r)
+    if ((r = read(fd, (char *) buf + off, len - off)) <= 0)
+      return -1;
+  return 0;
+}
+
+// the loop of a worker process, which never returns
+void batch_worker_loop(char **paths,
+                       struct options *o,
+                       int task_fd,
+                       int result_fd) {
+  struct verdict v;
+  char msg[512];
+  uint index;
+
+  while (read_full(task_fd, &index, sizeof(index)) == 0) {
+    memset(&v, 0, sizeof(v));
+    v.index = index;
+    v.rc = check_image(paths[index], o, msg, sizeof(msg));
+    msg[strcspn(msg, "\n")] = '\0';
+    snprintf(v.msg, sizeof(v.msg), "%.*s", (int) sizeof(v.msg) - 1, msg);
+    if (write(result_fd, &v, sizeof(v)) != sizeof(v))
+      exit(1);
+  }
+  exit(0);
+}
+
+// fork worker k of nworkers; the worker only keeps its own two pipes
+void start_worker(struct batch_worker *workers,
+                  int nworkers,
+                  int k,
+                  char **paths,
+                  struct options *o) {
+  struct batch_worker *w = &workers[k];
+  int task[2], result[2];
+
+  if ((pipe(task) < 0) || (pipe(result) < 0))
+    exit(1);
+  fflush(stdout);
+  if ((w->pid = fork()) < 0)
     exit(1);
+  if (w->pid == 0) {
+    for (int i = 0; i < nworkers; i++) {
+      if ((i == k) || (workers[i].pid == 0))
+        continue;
+      close(workers[i].task_fd);
+      close(workers[i].result_fd);
+    }
+    close(task[1]);
+    close(result[0]);
+    batch_worker_loop(paths, o, task[0], result[1]);
+  }
+  close(task[0]);
+  close(result[1]);
+  w->task_fd = task[1];
+  w->result_fd = result[0];
+  w->busy = 0;
+}
 
-  img_ptr = mmap(NULL,
-		 sbuf.st_size,
-		 PROT_READ | PROT_WRITE,
-		 MAP_SHARED,
-		 fd,
-		 0);
-  if (img_ptr == MAP_FAILED)
+// a worker died while checking an image; its verdict says how
+void worker_died(struct batch_worker *w, struct verdict *v) {
+  int status = 0;
+
+  waitpid(w->pid, &status, 0);
+  close(w->task_fd);
+  close(w->result_fd);
+  w->pid = 0;
+  memset(v, 0, sizeof(struct verdict));
+  v->index = w->index;
+  v->rc = 1;
+  if (WIFSIGNALED(status))
+    snprintf(v->msg, sizeof(v->msg), "ERROR: checker killed by signal %d.",
+             WTERMSIG(status));
+  else
+    snprintf(v->msg, sizeof(v->msg), "ERROR: checker exited with status %d.",
+             WEXITSTATUS(status));
+}
+
+// check every image in list with o->nthreads workers, printing one line per
+// image, in list order, as soon as it and those before it are done; returns
+// 1 if any image failed
+int run_batch(char *list, struct options *o) {
+  struct options wo = *o;
+  struct batch_worker *workers;
+  struct verdict *verdicts, v;
+  struct pollfd *fds;
+  char *done;
+  uint n, next, ndone, printed;
+  int nworkers, k, failed;
+  char **paths = read_list(list, &n);
+
+  nworkers = ((uint) o->nthreads < n) ? o->nthreads : (int) n;
+  wo.nthreads = 1; // each image is checked by one thread of one worker
+  if (((workers = calloc(nworkers + 1, sizeof(struct batch_worker))) == NULL) ||
+      ((fds = calloc(nworkers + 1, sizeof(struct pollfd))) == NULL) ||
+      ((verdicts = calloc(n + 1, sizeof(struct verdict))) == NULL) ||
+      ((done = calloc(n + 1, sizeof(char))) == NULL))
     exit(1);
-  if (close(fd) < 0)
+
+  signal(SIGPIPE, SIG_IGN); // a dead worker shows up as a closed pipe
+  for (k = 0; k < nworkers; k++)
+    start_worker(workers, nworkers, k, paths, &wo);
+
+  next = ndone = printed = 0;
+  failed = 0;
+  while (ndone < n) {
+    for (k = 0; k < nworkers; k++) {
+      struct batch_worker *w = &workers[k];
+      if (w->busy || (next == n))
+        continue;
+      if (w->pid == 0)
+        start_worker(workers, nworkers, k, paths, &wo);
+      w->index = next++;
+      w->busy = 1;
+      if (write(w->task_fd, &w->index, sizeof(w->index)) < 0)
+        continue; // the worker is gone, which poll tells below
+    }
+
+    for (k = 0; k < nworkers; k++) {
+      fds[k].fd = workers[k].busy ? workers[k].result_fd : -1;
+      fds[k].events = POLLIN;
+      fds[k].revents = 0;
+    }
+    if (poll(fds, nworkers, -1) < 0)
+      exit(1);
+
+    for (k = 0; k < nworkers; k++) {
+      struct batch_worker *w = &workers[k];
+      if (!w->busy || (fds[k].revents == 0))
+        continue;
+      if ((read_full(w->result_fd, &v, sizeof(v)) < 0) || (v.index != w->index))
+        worker_died(w, &v);
+      w->busy = 0;
+      verdicts[v.index] = v;
+      done[v.index] = 1;
+      ndone++;
+    }
+
+    for (; (printed < n) && done[printed]; printed++) {
+      v = verdicts[printed];
+      printf("%s: %s\n", paths[printed], (v.rc == 0) ? "ok" : v.msg);
+      failed |= (v.rc != 0);
+    }
+    fflush(stdout);
+  }
+
+  for (k = 0; k < nworkers; k++) {
+    if (workers[k].pid == 0)
+      continue;
+    close(workers[k].task_fd); // the worker sees the end of its tasks
+    close(workers[k].result_fd);
+    waitpid(workers[k].pid, NULL, 0);
+  }
+  for (uint i = 0; i < n; i++)
+    free(paths[i]);
+  free(paths);
+  free(workers);
+  free(fds);
+  free(verdicts);
+  free(done);
+  return failed;
+}
+
+#ifndef XV6FSCK_LIB
+int main(int argc, char *argv[]) {
+  int rc, opt;
+  int threads_given = 0;
+  char *batch = NULL;
+  struct options o = { 1, 0, 0, DEFAULT_MAX_ERRORS, 0, NULL, 0, 0, NULL };
+  char *apply = NULL;
+
+  struct option long_opts[] = {
+    { "cache-mb", required_argument, NULL, 'c' },
+    { "all", no_argument, NULL, 'a' },
+    { "max-errors", required_argument, NULL, 'm' },
+    { "stats", no_argument, NULL, 's' },
+    { "incremental", required_argument, NULL, 'i' },
+    { "batch", required_argument, NULL, 'b' },
+    { "dry-run", no_argument, NULL, 'n' },
+    { "patch", required_argument, NULL, 'p' },
+    { "apply-patch", required_argument, NULL, 'P' },
+    { "readahead", no_argument, NULL, 'R' },
+    { "populate", no_argument, NULL, 'M' },
+    { "io-depth", required_argument, NULL, 'q' },
+    { "quick", no_argument, NULL, 'Q' },
+    { "standard", no_argument, NULL, 'S' },
+    { "thorough", no_argument, NULL, 'T' },
+    { "stop-after", required_argument, NULL, 'e' },
+    { "memory-limit", required_argument, NULL, 'L' },
+    { "verbose", no_argument, NULL, 'v' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  opterr = 0;
+  while ((opt = getopt_long(argc, argv, "rvj:", long_opts, NULL)) != -1) {
+    switch(opt) {
+      case 'r' :
+        o.repair = 1;
+        break;
+      case 'v' : // say where a failed check failed, below the error
+        o.verbose = 1;
+        break;
+      case 'j' : // threads scanning the inode table, or batch workers
+        o.nthreads = atoi(optarg);
+        if ((o.nthreads < 1) || (o.nthreads > 1024))
+          exit(1);
+        threads_given = 1;
+        break;
+      case 'c' : // stream the image through a cache of this many MB
+        o.cache_mb = atoi(optarg);
+        if (o.cache_mb < 1)
+          exit(1);
+        break;
+      case 'a' : // report every violation instead of the first
+        o.report_all = 1;
+        break;
+      case 'm' : // violations kept by --all
+        o.max_errors = atoi(optarg);
+        if (o.max_errors < 0)
+          exit(1);
+        break;
+      case 's' : // print what each stage cost
+        o.stats = 1;
+        break;
+      case 'i' : // keep a summary of the image in this file between runs
+        o.summary = optarg;
+        break;
+      case 'b' : // check every image listed in this file, - for stdin
+        batch = optarg;
+        break;
+      case 'n' : // write nothing to the image
+        o.dry_run = 1;
+        break;
+      case 'p' : // save what a repair changes to this file
+        o.patch = optarg;
+        break;
+      case 'P' : // write what this patch file holds to the image
+        apply = optarg;
+        break;
+      case 'R' : // read ahead the blocks the inodes name, in block order
+        o.readahead = 1;
+        break;
+      case 'M' : // read the mapped image in whole
+        o.populate = 1;
+        break;
+      case 'q' : // reads kept in flight by each scan thread when streaming
+        o.io_depth = atoi(optarg);
+        if ((o.io_depth < 0) || (o.io_depth > 4096))
+          exit(1);
+        break;
+      case 'Q' : // checks #0-6 only
+        o.tier = TIER_QUICK;
+        break;
+      case 'S' : // checks #0-12
+        o.tier = TIER_STANDARD;
+        break;
+      case 'T' : // every check, the default
+        o.tier = TIER_THOROUGH;
+        break;
+      case 'e' : // --all looks for no more violations than this
+        o.stop_after = atoi(optarg);
+        if (o.stop_after < 1)
+          exit(1);
+        break;
+      case 'L' : // scratch space the checks may take, in megabytes
+        if (atoi(optarg) < 1)
+          exit(1);
+        o.memory_limit = (size_t) atoi(optarg) << 20;
+        break;
+      default : // unknown flag, exit without doing anything
+        exit(1);
+    }
+  }
+
+  // a batch takes its images from the list, and gives one verdict line each
+  if ((batch != NULL) &&
+      ((optind != argc) || o.repair || o.report_all || o.stats ||
+       (o.summary != NULL) || o.dry_run || (o.patch != NULL) ||
+       (apply != NULL)))
+    exit(1);
+  if (batch != NULL) {
+    if (!threads_given) // one worker per processor
+      o.nthreads = (sysconf(_SC_NPROCESSORS_ONLN) > 0) ?
+                   sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    return run_batch(batch, &o);
+  }
+
+  if (optind != argc - 1) {
+    fprintf(stderr, "Usage: xv6_fsck [-v] [-r [--dry-run] [--patch PATCH]] "
+                    "[-j threads] [--cache-mb MB [--io-depth N]] "
+                    "[--readahead] [--populate] "
+                    "[--quick | --standard | --thorough] "
+                    "[--all [--max-errors N] [--stop-after N]] "
+                    "[--incremental SUMMARY] [--memory-limit MB] [--stats] "
+                    "<file_system_image>.\n"
+                    "       xv6_fsck [-j workers] [--cache-mb MB "
+                    "[--io-depth N]] [--readahead] [--populate] "
+                    "[--quick | --standard | --thorough] [--memory-limit MB] "
+                    "--batch <list of images, or ->.\n"
+                    "       xv6_fsck [--dry-run] --apply-patch PATCH "
+                    "<file_system_image>.\n");
     exit(1);
-  
-  sb = (struct superblock *) (img_ptr + BSIZE);
-  dip = (struct dinode *) (img_ptr + (2*BSIZE));
+  }
 
-  repair(img_ptr, dip, sb->ninodes);
+  // a repair is not a report, nor does it keep a summary; a patch is
+  // applied without checking the image again
+  if (o.repair && (o.report_all || (o.summary != NULL)))
+    exit(1);
+  // a repair and a summary need every record a thorough scan keeps, and
+  // only --all stops after a count
+  if ((o.tier != TIER_THOROUGH) && (o.repair || (o.summary != NULL)))
+    exit(1);
+  if ((o.stop_after != 0) && !o.report_all)
+    exit(1);
+  // a repair, --all and a summary need every record at once
+  if ((o.memory_limit != 0) &&
+      (o.repair || o.report_all || (o.summary != NULL)))
+    exit(1);
+  if ((o.dry_run || (o.patch != NULL)) && !o.repair && (apply == NULL))
+    exit(1);
+  if ((apply != NULL) &&
+      (o.repair || (o.patch != NULL) || o.report_all || o.stats ||
+       (o.summary != NULL) || o.readahead || o.populate || o.io_depth ||
+       (o.tier != TIER_THOROUGH) || o.memory_limit))
+    exit(1);
 
-  if (munmap(img_ptr, sbuf.st_size) < 0)
+  char msg[512]; // an error and the line below it
+  if (apply != NULL)
+    rc = apply_patch(argv[optind], apply, o.dry_run, msg, sizeof(msg));
+  else
+    rc = check_image(argv[optind], &o, msg, sizeof(msg));
+  fputs(msg, stderr);
+  if (rc != 0)
     exit(1);
 
   return 0;
 }
+#endif
@@ -0,0 +1,463 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <getopt.h>
+
+// Builds xv6 file system images for xv6_fsck: a directory tree of a given
+// depth and fan-out, optionally with one corruption that makes exactly one
+// check fail first.
+//
+// The fs.h definitions below are copied from xv6, as in xv6_fsck.c, with
+// the block size an argument.
+
+// Block 0 is unused.
+// Block 1 is super block.
+// Inodes start at block 2, or after the log.
+
+#define ROOTINO 1  // root i-number
+#define BSIZE 512  // block size
+
+// the layouts xv6_fsck knows, as there
+enum { LAYOUT_V6, LAYOUT_LOG, LAYOUT_RISCV };
+
+#define MAXBSIZE 1024  // RISC-V block size
+#define FSMAGIC 0x10203040
+#define LOGSIZE 30     // log blocks, as xv6 param.h
+
+// File system super block; v6 stores the first three fields, log the first
+// seven, riscv the seven after FSMAGIC
+struct superblock {
+  uint size;         // Size of file system image (blocks)
+  uint nblocks;      // Number of data blocks
+  uint ninodes;      // Number of inodes.
+  uint nlog;         // Number of log blocks
+  uint logstart;     // Block number of first log block
+  uint inodestart;   // Block number of first inode block
+  uint bmapstart;    // Block number of first free map block
+  uint bsize;        // block size, not stored
+};
+
+#define NDIRECT (12)
+#define NINDIRECT(bs) ((bs) / sizeof(uint))
+#define MAXFILE(bs) (NDIRECT + NINDIRECT(bs))
+
+struct dinode {
+  short type;           // File type
+  short major;          // Major device number (T_DEV only)
+  short minor;          // Minor device number (T_DEV only)
+  short nlink;          // Number of links to inode in file system
+  uint size;            // Size of file (bytes)
+  uint addrs[NDIRECT+1];   // Data block addresses
+};
+
+#define T_DIR  1   // Directory
+#define T_FILE 2   // File
+#define T_DEV  3   // Special device
+
+// Inodes per block.
+#define IPB(bs)       ((bs) / sizeof(struct dinode))
+
+// Block containing inode i
+#define IBLOCK(i, sb) ((i) / IPB((sb)->bsize) + (sb)->inodestart)
+
+// Bitmap bits per block
+#define BPB(bs)       ((bs)*8)
+
+// Block containing bit for block b
+#define BBLOCK(b, sb) ((b) / BPB((sb)->bsize) + (sb)->bmapstart)
+
+// Directory is a file containing a sequence of dirent structures.
+#define DIRSIZ 14
+
+struct dirent {
+  ushort inum;
+  char name[DIRSIZ];
+};
+
+// Dirents per block
+#define DPB(bs) ((bs)/sizeof(struct dirent))
+
+// dirents hold ushort inums, so no more inodes than this can be named
+#define MAXINUM 65535
+
+// the image being built
+struct image {
+  char *mem;
+  struct superblock sb;
+  uint next_block;  // next free data block
+  uint next_inum;   // next free inode
+  uint last_inum;   // last inode that may be allocated
+  uint dataend;     // xv6_fsck's check #6 looks at blocks below this
+  uint seed;
+};
+
+char *block_at(struct image *img, uint b) {
+  return img->mem + (size_t) b*img->sb.bsize;
+}
+
+struct dinode *inode_at(struct image *img, uint inum) {
+  return (struct dinode *) block_at(img, IBLOCK(inum, &img->sb)) +
+         inum % IPB(img->sb.bsize);
+}
+
+void set_bit(struct image *img, uint b, int on) {
+  char *byte = block_at(img, BBLOCK(b, &img->sb)) +
+               (b % BPB(img->sb.bsize)) / 8;
+  if (on)
+    *byte |= 1 << (b % 8);
+  else
+    *byte &= ~(1 << (b % 8));
+}
+
+// a random number from the image's seed
+uint next_rand(struct image *img) {
+  img->seed = img->seed*1103515245 + 12345;
+  return (img->seed >> 16) & 0x7fff;
+}
+
+uint alloc_block(struct image *img) {
+  if (img->next_block >= img->sb.size) {
+    fprintf(stderr, "image too small, raise -b.\n");
+    exit(1);
+  }
+  set_bit(img, img->next_block, 1);
+  return img->next_block++;
+}
+
+// an unused inode, or 0 if none is left
+uint alloc_inode(struct image *img, short type) {
+  uint inum = img->next_inum;
+  if (inum > img->last_inum)
+    return 0;
+  img->next_inum++;
+  inode_at(img, inum)->type = type;
+  inode_at(img, inum)->nlink = 1;
+  return inum;
+}
+
+// address of the k-th block of an inode, for k < MAXFILE(bsize)
+uint *block_addr(struct image *img, struct dinode *dip, uint k) {
+  if (k < NDIRECT)
+    return &dip->addrs[k];
+  if (dip->addrs[NDIRECT] == 0)
+    dip->addrs[NDIRECT] = alloc_block(img);
+  return (uint *) block_at(img, dip->addrs[NDIRECT]) + (k - NDIRECT);
+}
+
+// give a file n data blocks
+void fill_file(struct image *img, uint inum, uint n) {
+  struct dinode *dip = inode_at(img, inum);
+  for (uint k = 0; k < n; k++)
+    *block_addr(img, dip, k) = alloc_block(img);
+  dip->size = n*img->sb.bsize;
+}
+
+// append an entry to a directory; returns -1 once the directory is full
+int add_dirent(struct image *img, uint dir, ushort inum, char *name) {
+  struct dinode *dip = inode_at(img, dir);
+  uint n = dip->size / sizeof(struct dirent), dpb = DPB(img->sb.bsize);
+  struct dirent *d_entry;
+
+  if (n == MAXFILE(img->sb.bsize)*dpb)
+    return -1;
+  if (n % dpb == 0)
+    *block_addr(img, dip, n / dpb) = alloc_block(img);
+
+  d_entry = (struct dirent *) block_at(img, *block_addr(img, dip, n / dpb));
+  d_entry += n % dpb;
+  d_entry->inum = inum;
+  memset(d_entry->name, 0, DIRSIZ); // unterminated if DIRSIZ long
+  memcpy(d_entry->name, name, strnlen(name, DIRSIZ));
+  dip->size += sizeof(struct dirent);
+  return 0;
+}
+
+// write the . and .. entries of a new directory
+void make_dir(struct image *img, uint dir, uint parent) {
+  add_dirent(img, dir, dir, ".");
+  add_dirent(img, dir, parent, "..");
+}
+
+// the tree, built breadth first so that each directory is written whole
+struct tree {
+  int depth;       // levels of directories below the root
+  int fanout;      // directories in each directory
+  int files;       // files in each directory
+  int file_blocks; // most data blocks in a file, above NDIRECT uses indirect
+};
+
+void build_tree(struct image *img, struct tree *t) {
+  uint *queue;
+  int *level;
+  uint head, tail, dir, child;
+  char name[DIRSIZ + 1];
+  int i;
+
+  if (((queue = malloc((MAXINUM + 1)*sizeof(uint))) == NULL) ||
+      ((level = malloc((MAXINUM + 1)*sizeof(int))) == NULL))
+    exit(1);
+
+  img->next_inum = ROOTINO;
+  dir = alloc_inode(img, T_DIR);
+  make_dir(img, dir, dir);
+  // repair puts lost inodes here
+  if ((child = alloc_inode(img, T_DIR)) != 0) {
+    make_dir(img, child, dir);
+    add_dirent(img, dir, child, "lost_found");
+  }
+
+  head = tail = 0;
+  queue[tail] = dir;
+  level[tail++] = 0;
+  while (head < tail) {
+    dir = queue[head];
+    for (i = 0; (i < t->fanout) && (level[head] < t->depth); i++) {
+      if ((child = alloc_inode(img, T_DIR)) == 0)
+        break;
+      snprintf(name, sizeof(name), "d%d", i);
+      if (add_dirent(img, dir, child, name) < 0)
+        break;
+      make_dir(img, child, dir);
+      queue[tail] = child;
+      level[tail++] = level[head] + 1;
+    }
+
+    for (i = 0; i < t->files; i++) {
+      if ((child = alloc_inode(img, T_FILE)) == 0)
+        break;
+      snprintf(name, sizeof(name), "f%d", i);
+      if (add_dirent(img, dir, child, name) < 0)
+        break;
+      fill_file(img, child, next_rand(img) % (t->file_blocks + 1));
+    }
+    head++;
+  }
+  free(queue);
+  free(level);
+}
+
+// find an in-use inode of a type, passing the first skip of them; 0 if none
+uint find_inode(struct image *img, short type, uint skip) {
+  for (uint i = ROOTINO + 1; i < img->next_inum; i++)
+    if ((inode_at(img, i)->type == type) && (skip-- == 0))
+      return i;
+  return 0;
+}
+
+// a file with at least n blocks, passing the first skip of them; 0 if none
+uint find_file(struct image *img, uint n, uint skip) {
+  for (uint i = ROOTINO + 1; i < img->next_inum; i++) {
+    struct dinode *dip = inode_at(img, i);
+    if ((dip->type == T_FILE) && (dip->size >= n*img->sb.bsize) &&
+        (skip-- == 0))
+      return i;
+  }
+  return 0;
+}
+
+// the dirent of dir at index k
+struct dirent *dirent_at(struct image *img, uint dir, uint k) {
+  struct dinode *dip = inode_at(img, dir);
+  uint dpb = DPB(img->sb.bsize);
+  struct dirent *d_entry;
+  d_entry = (struct dirent *) block_at(img, *block_addr(img, dip, k / dpb));
+  return d_entry + k % dpb;
+}
+
+void need(uint inum, char *what) {
+  if (inum == 0) {
+    fprintf(stderr, "no %s to corrupt, grow the tree.\n", what);
+    exit(1);
+  }
+}
+
+// break the image so that check fails before any other
+void corrupt(struct image *img, char *check) {
+  uint a, b;
+  struct dinode *dip;
+
+  if (strcmp(check, "1") == 0) { // a type xv6 does not have
+    need(a = find_inode(img, T_FILE, 0), "file");
+    inode_at(img, a)->type = 7;
+  } else if (strcmp(check, "2A") == 0) { // a direct address past the image
+    need(a = find_file(img, 1, 0), "file with data");
+    inode_at(img, a)->addrs[0] = img->sb.size + 1;
+  } else if (strcmp(check, "2B") == 0) { // an indirect address past it
+    need(a = find_file(img, NDIRECT + 1, 0), "file using indirect blocks");
+    *block_addr(img, inode_at(img, a), NDIRECT) = img->sb.size + 1;
+  } else if (strcmp(check, "3") == 0) { // root is not a directory
+    inode_at(img, ROOTINO)->type = T_FILE;
+  } else if (strcmp(check, "4") == 0) { // . names the parent
+    need(a = find_inode(img, T_DIR, 1), "directory below the root");
+    dirent_at(img, a, 0)->inum = dirent_at(img, a, 1)->inum;
+  } else if (strcmp(check, "5") == 0) { // a block in use marked free
+    need(a = find_file(img, 1, 0), "file with data");
+    set_bit(img, inode_at(img, a)->addrs[0], 0);
+  } else if (strcmp(check, "6") == 0) { // a free block marked in use
+    if (img->next_block >= img->dataend) {
+      fprintf(stderr, "no free data block, raise -b.\n");
+      exit(1);
+    }
+    set_bit(img, img->next_block, 1);
+  } else if (strcmp(check, "7") == 0) { // two files share a direct block
+    need(a = find_file(img, 1, 0), "file with data");
+    need(b = find_file(img, 1, 1), "second file with data");
+    dip = inode_at(img, b);
+    set_bit(img, dip->addrs[0], 0);
+    dip->addrs[0] = inode_at(img, a)->addrs[0];
+  } else if (strcmp(check, "8") == 0) { // two files share an indirect block
+    need(a = find_file(img, NDIRECT + 1, 0), "file using indirect blocks");
+    need(b = find_file(img, NDIRECT + 1, 1), "second such file");
+    uint *addr = block_addr(img, inode_at(img, b), NDIRECT);
+    set_bit(img, *addr, 0);
+    *addr = *block_addr(img, inode_at(img, a), NDIRECT);
+  } else if (strcmp(check, "9") == 0) { // a file in no directory
+    need(alloc_inode(img, T_FILE), "free inode");
+  } else if (strcmp(check, "10") == 0) { // an entry naming a free inode
+    need(img->next_inum <= img->last_inum, "free inode");
+    add_dirent(img, ROOTINO, img->next_inum, "free");
+  } else if (strcmp(check, "11") == 0) { // one link too many
+    need(a = find_inode(img, T_FILE, 0), "file");
+    inode_at(img, a)->nlink++;
+  } else if (strcmp(check, "12") == 0) { // a directory named twice
+    need(a = find_inode(img, T_DIR, 1), "directory below the root");
+    add_dirent(img, ROOTINO, a, "again");
+  } else if (strcmp(check, "E1") == 0) { // .. names a sibling
+    need(a = find_inode(img, T_DIR, 1), "directory below the root");
+    need(b = find_inode(img, T_DIR, 2), "second directory below the root");
+    dirent_at(img, a, 1)->inum = b;
+  } else if (strcmp(check, "E2") == 0) { // two directories naming each other
+    need(a = alloc_inode(img, T_DIR), "free inode");
+    need(b = alloc_inode(img, T_DIR), "second free inode");
+    make_dir(img, a, b);
+    add_dirent(img, a, b, "loop");
+    make_dir(img, b, a);
+    add_dirent(img, b, a, "loop");
+  } else {
+    fprintf(stderr, "unknown check %s.\n", check);
+    exit(1);
+  }
+}
+
+// the image being built, until it is finished; every failure past creating
+// it exits, and the half-built image is removed on the way out
+char *unfinished;
+
+void remove_unfinished(void) {
+  if (unfinished != NULL)
+    unlink(unfinished);
+}
+
+int main(int argc, char *argv[]) {
+  struct image img = { 0 };
+  struct tree t = { 3, 3, 3, 4 };
+  uint ninodes = 200, size = 1024;
+  char *check = NULL;
+  int opt, fd, layout = LAYOUT_V6;
+
+  while ((opt = getopt(argc, argv, "i:b:d:f:n:k:c:s:l:")) != -1) {
+    switch(opt) {
+      case 'i' : // inodes in the inode table
+        ninodes = strtoul(optarg, NULL, 10);
+        break;
+      case 'b' : // blocks in the image
+        size = strtoul(optarg, NULL, 10);
+        break;
+      case 'd' :
+        t.depth = atoi(optarg);
+        break;
+      case 'f' :
+        t.fanout = atoi(optarg);
+        break;
+      case 'n' :
+        t.files = atoi(optarg);
+        break;
+      case 'k' :
+        t.file_blocks = atoi(optarg);
+        break;
+      case 'c' : // check to make fail
+        check = optarg;
+        break;
+      case 's' :
+        img.seed = strtoul(optarg, NULL, 10);
+        break;
+      case 'l' : // layout
+        if (strcmp(optarg, "log") == 0)
+          layout = LAYOUT_LOG;
+        else if (strcmp(optarg, "riscv") == 0)
+          layout = LAYOUT_RISCV;
+        else if (strcmp(optarg, "v6") != 0)
+          exit(1);
+        break;
+      default : // unknown flag, exit without doing anything
+        exit(1);
+    }
+  }
+
+  uint bsize = (layout == LAYOUT_RISCV) ? MAXBSIZE : BSIZE;
+  if ((optind != argc - 1) || (ninodes < 5) || (t.file_blocks < 0) ||
+      (t.file_blocks > (int) MAXFILE(bsize))) {
+    fprintf(stderr, "Usage: xv6_mkimg [-i inodes] [-b blocks] [-d depth] "
+                    "[-f fanout] [-n files] [-k file_blocks] [-c check] "
+                    "[-s seed] [-l v6|log|riscv] <file_system_image>.\n");
+    exit(1);
+  }
+
+  // layout as xv6 mkfs: boot block, super block, log, inodes, bitmap, data
+  img.sb.bsize = bsize;
+  img.sb.nlog = (layout == LAYOUT_V6) ? 0 : LOGSIZE;
+  img.sb.logstart = (layout == LAYOUT_V6) ? 0 : 2;
+  img.sb.inodestart = 2 + img.sb.nlog;
+  img.sb.bmapstart = img.sb.inodestart + ninodes / IPB(bsize) + 1;
+  uint meta = img.sb.bmapstart + (size / BPB(bsize) + 1);
+  if (size <= meta) {
+    fprintf(stderr, "image too small, raise -b.\n");
+    exit(1);
+  }
+  img.sb.size = size;
+  img.sb.nblocks = size - meta;
+  img.sb.ninodes = ninodes;
+  // xv6_fsck takes v6 data blocks to end at nblocks
+  img.dataend = (layout == LAYOUT_V6) ? img.sb.nblocks : size;
+
+  fd = open(argv[optind], O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    exit(1);
+  unfinished = argv[optind];
+  atexit(remove_unfinished);
+  if (ftruncate(fd, (off_t) size*bsize) < 0)
+    exit(1);
+  img.mem = mmap(NULL, (size_t) size*bsize, PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, 0);
+  if (img.mem == MAP_FAILED)
+    exit(1);
+
+  uint *sb_out = (uint *) block_at(&img, 1);
+  if (layout == LAYOUT_RISCV)
+    *sb_out++ = FSMAGIC;
+  memcpy(sb_out, &img.sb, (layout == LAYOUT_V6) ? 3*sizeof(uint) :
+                                                  7*sizeof(uint));
+  for (img.next_block = 0; img.next_block < meta; img.next_block++)
+    set_bit(&img, img.next_block, 1);
+
+  // the tree leaves two inodes for corruptions that add inodes
+  img.last_inum = (ninodes - 1 < MAXINUM) ? ninodes - 1 : MAXINUM;
+  img.last_inum -= 2;
+  build_tree(&img, &t);
+  img.last_inum += 2;
+  if (check != NULL)
+    corrupt(&img, check);
+
+  if (munmap(img.mem, (size_t) size*bsize) < 0)
+    exit(1);
+  if (close(fd) < 0)
+    exit(1);
+  unfinished = NULL;
+  return 0;
+}
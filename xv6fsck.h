@@ -0,0 +1,77 @@
+// xv6fsck.h
+// The checker as a library, for checking images held in memory, e.g. by a
+// test harness or a tool that builds them. Built from xv6_fsck.c with
+// XV6FSCK_LIB defined, which leaves out main(); see README.
+//
+// xv6fsck_check runs the same checks as xv6_fsck on an image of len bytes
+// at image, which it only reads and never copies. It is reentrant: images
+// may be checked from any number of threads at once. It never exits the
+// process and writes nothing to stdout or stderr.
+
+#ifndef XV6FSCK_H
+#define XV6FSCK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef XV6FSCK_API
+#define XV6FSCK_API __attribute__((visibility("default")))
+#endif
+
+// one failed check, as a line of xv6_fsck --all
+struct xv6fsck_violation {
+  const char *check;    // "0"-"12", "2A", "2B", "E1" or "E2"
+  const char *error;    // the message, as in --all, e.g. "bad inode."; only
+                        // valid during the call it is passed to
+  int64_t inode;        // inode at fault, or -1
+  int64_t block;        // block at fault, or holding the dirent, or -1
+  int offset;           // byte offset of that dirent in block, or -1
+  int64_t other;        // the other inode involved, or -1
+  const char *path;     // where the inode is named, e.g. /a/b/file, or
+                        // NULL; only valid during the call it is passed to
+};
+
+// how far the checks go, as xv6_fsck --thorough, --standard and --quick
+enum { XV6FSCK_THOROUGH, XV6FSCK_STANDARD, XV6FSCK_QUICK };
+
+struct xv6fsck_options {
+  int nthreads;         // scan threads, as -j; 0 for 1
+  int report_all;       // run every check, as --all
+  int max_errors;       // violations passed on with report_all, as
+                        // --max-errors; 0 for 10000, -1 for none
+  int tier;             // XV6FSCK_*, the default thorough
+  int stop_after;       // with report_all, violations to stop at, as
+                        // --stop-after; 0 never to stop
+  // called with each violation kept with report_all, in the order xv6_fsck
+  // --all writes them, on the thread that called xv6fsck_check
+  void (*violation)(const struct xv6fsck_violation *v, void *arg);
+  void *arg;
+  int verbose;          // add the line below the error to message, as -v
+};
+
+struct xv6fsck_result {
+  int failed;           // 1 if any check failed
+  const char *check;    // the first that did, as in xv6fsck_violation, or
+                        // NULL if none did or report_all kept none
+  char message[512];    // what xv6_fsck prints for it, "" with report_all
+  uint64_t violations;  // found with report_all, kept or not
+};
+
+// check the image, as asked by opts (NULL for the defaults); returns 0 when
+// every check passes, 1 when one fails and -1 when the check could not be
+// made for want of memory or threads, or was asked of an empty image or an
+// unknown tier. result, if not NULL, is filled in when 0 or 1 is returned
+XV6FSCK_API int xv6fsck_check(const void *image,
+                              size_t len,
+                              const struct xv6fsck_options *opts,
+                              struct xv6fsck_result *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // XV6FSCK_H